@@ -0,0 +1,257 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include "ray.h"
+
+#include <vector>
+#include <limits>
+#include <algorithm>
+#include <cstdint>
+
+// BOUNDING VOLUME HIERARCHY //
+// used inside every mesh (over its faces) and once for the whole scene (over the meshes) //
+
+
+struct AABB {
+    point3 min = point3(std::numeric_limits<double>::infinity(),
+                        std::numeric_limits<double>::infinity(),
+                        std::numeric_limits<double>::infinity());
+    point3 max = point3(-std::numeric_limits<double>::infinity(),
+                        -std::numeric_limits<double>::infinity(),
+                        -std::numeric_limits<double>::infinity());
+
+    void grow(const point3& point) {
+        for (int i = 0; i < 3; i++) {
+            min[i] = std::min(min[i], point[i]);
+            max[i] = std::max(max[i], point[i]);
+        }
+    }
+
+    void grow(const AABB& box) {
+        grow(box.min);
+        grow(box.max);
+    }
+
+    point3 centroid() const {
+        return (min + max) * 0.5;
+    }
+
+    double surface_area() const {
+        vec3 extent = max - min;
+        if (extent.x() < 0) {
+            return 0; // empty box
+        }
+        return 2 * (extent.x() * extent.y() + extent.y() * extent.z() + extent.z() * extent.x());
+    }
+
+    // slab test, returns the entry time or infinity if the box is missed (or further away than t_max)
+    double hit(const point3& origin, const vec3& inverse_direction, double t_max) const {
+        double t_min = 0;
+        for (int i = 0; i < 3; i++) {
+            double t1 = (min[i] - origin[i]) * inverse_direction[i];
+            double t2 = (max[i] - origin[i]) * inverse_direction[i];
+            if (t1 > t2) {
+                std::swap(t1, t2);
+            }
+            t_min = std::max(t_min, t1);
+            t_max = std::min(t_max, t2);
+        }
+        return t_min <= t_max ? t_min : std::numeric_limits<double>::infinity();
+    }
+};
+
+// up to 64 rays that start on lines through the same point and point in similar directions
+// (the camera rays of a pixel block), traced together through the hierarchy
+struct RayPacket {
+    static constexpr int max_size = 64; // one bit per ray in a uint64_t mask
+
+    int size = 0;
+    ray rays[max_size];
+    vec3 inverse_directions[max_size];
+    double closest_times[max_size]; // closest hit of every ray so far
+
+    // frustum around all rays (planes point inwards), only there if build_frustum succeeded
+    bool has_frustum = false;
+    vec3 frustum_normals[5];
+    double frustum_offsets[5];
+
+    void add(const ray& render_ray) {
+        rays[size] = render_ray;
+        inverse_directions[size] = vec3(1 / render_ray.direction().x(), 1 / render_ray.direction().y(), 1 / render_ray.direction().z());
+        closest_times[size] = std::numeric_limits<double>::max();
+        size++;
+    }
+
+    uint64_t full_mask() const {
+        return size == max_size ? ~uint64_t(0) : (uint64_t(1) << size) - 1;
+    }
+
+    // builds the frustum from the apex the rays come from, fails if the rays do not all point
+    // into the same half space (the packet diverges too much to be culled as a whole)
+    bool build_frustum(const point3& apex);
+
+    // true if the box lies completely outside of one of the frustum planes
+    bool frustum_misses(const AABB& box) const {
+        for (int p = 0; p < 5; p++) {
+            const vec3& normal = frustum_normals[p];
+            point3 corner(normal.x() >= 0 ? box.max.x() : box.min.x(), // corner furthest along the normal
+                          normal.y() >= 0 ? box.max.y() : box.min.y(),
+                          normal.z() >= 0 ? box.max.z() : box.min.z());
+            if (dot(normal, corner) < frustum_offsets[p] - 1e-9) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // first ray (starting at first) in the mask that hits the box before its closest hit, -1 if none does
+    int first_hit(const AABB& box, uint64_t mask, int first) const {
+        for (int r = first; r < size; r++) {
+            if (((mask >> r) & 1) && box.hit(rays[r].origin(), inverse_directions[r], closest_times[r]) != std::numeric_limits<double>::infinity()) {
+                return r;
+            }
+        }
+        return -1;
+    }
+};
+
+struct BVHNode {
+    AABB bounds;
+    int first_or_right; // leaf: first entry in primitive_indices, inner node: index of the right child
+    int count;          // number of primitives in a leaf, 0 for inner nodes (left child is always the next node)
+};
+
+
+class BVH {
+public:
+    // builds the tree over the bounding boxes of the primitives,
+    // subtrees with more than parallel_threshold primitives are built on their own thread (in the top
+    // log2(cores) levels of the tree only)
+    void build(const std::vector<AABB>& primitive_bounds, int parallel_threshold = 4096);
+
+    bool empty() const { return nodes.empty(); }
+    size_t memory_size() const { return nodes.size() * sizeof(BVHNode) + primitive_indices.size() * sizeof(int); }
+
+    // calls intersect(primitive_index, closest_time) for every primitive whose leaf is hit before closest_time,
+    // intersect has to lower closest_time when it finds a closer hit
+    template <typename Intersect>
+    void traverse(const ray& render_ray, double& closest_time, Intersect&& intersect) const {
+        if (nodes.empty()) {
+            return;
+        }
+        vec3 inverse_direction(1 / render_ray.direction().x(), 1 / render_ray.direction().y(), 1 / render_ray.direction().z());
+        const point3& origin = render_ray.origin();
+
+        int stack[64];
+        int stack_size = 0;
+        int node_index = 0;
+        if (nodes[0].bounds.hit(origin, inverse_direction, closest_time) == std::numeric_limits<double>::infinity()) {
+            return;
+        }
+
+        while (true) {
+            const BVHNode& node = nodes[node_index];
+            if (node.count > 0) { // leaf
+                for (int i = node.first_or_right; i < node.first_or_right + node.count; i++) {
+                    intersect(primitive_indices[i], closest_time);
+                }
+            }
+            else { // visit the closer child first
+                int left = node_index + 1;
+                int right = node.first_or_right;
+                double t_left = nodes[left].bounds.hit(origin, inverse_direction, closest_time);
+                double t_right = nodes[right].bounds.hit(origin, inverse_direction, closest_time);
+                if (t_left > t_right) {
+                    std::swap(t_left, t_right);
+                    std::swap(left, right);
+                }
+                if (t_left != std::numeric_limits<double>::infinity()) {
+                    if (t_right != std::numeric_limits<double>::infinity()) {
+                        stack[stack_size++] = right;
+                    }
+                    node_index = left;
+                    continue;
+                }
+            }
+
+            // pop the next node that is still in front of the closest hit
+            bool found = false;
+            while (stack_size > 0) {
+                node_index = stack[--stack_size];
+                if (nodes[node_index].bounds.hit(origin, inverse_direction, closest_time) != std::numeric_limits<double>::infinity()) {
+                    found = true;
+                    break;
+                }
+            }
+            if (!found) {
+                return;
+            }
+        }
+    }
+
+    // packet version of traverse: a node is skipped if it lies outside the frustum of the packet or if none
+    // of the rays in the mask hits it (searching from the first ray that hit the parent, so for coherent rays
+    // usually a single box test per node). calls intersect(primitive_index, ray_mask) for every primitive of a
+    // leaf with the rays that hit the leaf, intersect has to lower packet.closest_times when it finds closer hits
+    template <typename Intersect>
+    void traverse_packet(RayPacket& packet, uint64_t mask, Intersect&& intersect) const {
+        if (nodes.empty() || mask == 0) {
+            return;
+        }
+        struct StackEntry {
+            int node_index;
+            int first_ray;
+        };
+        StackEntry stack[64];
+        int stack_size = 0;
+        stack[stack_size++] = {0, 0};
+
+        while (stack_size > 0) {
+            StackEntry entry = stack[--stack_size];
+            const BVHNode& node = nodes[entry.node_index];
+            if (packet.has_frustum && packet.frustum_misses(node.bounds)) {
+                continue; // culls the whole packet with one test
+            }
+            int first = packet.first_hit(node.bounds, mask, entry.first_ray);
+            if (first < 0) {
+                continue;
+            }
+
+            if (node.count > 0) { // leaf, find all rays that reach it
+                uint64_t leaf_mask = 0;
+                for (int r = first; r < packet.size; r++) {
+                    if (((mask >> r) & 1) && node.bounds.hit(packet.rays[r].origin(), packet.inverse_directions[r], packet.closest_times[r])
+                                             != std::numeric_limits<double>::infinity()) {
+                        leaf_mask |= uint64_t(1) << r;
+                    }
+                }
+                for (int i = node.first_or_right; i < node.first_or_right + node.count; i++) {
+                    intersect(primitive_indices[i], leaf_mask);
+                }
+                continue;
+            }
+
+            // the first active ray decides which child is visited first
+            int left = entry.node_index + 1;
+            int right = node.first_or_right;
+            const point3& origin = packet.rays[first].origin();
+            double t_left = nodes[left].bounds.hit(origin, packet.inverse_directions[first], packet.closest_times[first]);
+            double t_right = nodes[right].bounds.hit(origin, packet.inverse_directions[first], packet.closest_times[first]);
+            if (t_left > t_right) {
+                std::swap(left, right);
+            }
+            stack[stack_size++] = {right, first};
+            stack[stack_size++] = {left, first};
+        }
+    }
+
+    std::vector<BVHNode> nodes;
+    std::vector<int> primitive_indices;
+
+private:
+    void build_subtree(std::vector<BVHNode>& out, const std::vector<AABB>& primitive_bounds,
+                       const std::vector<point3>& centroids, int begin, int end, int depth, int parallel_threshold,
+                       int parallel_depth);
+};
+
+#endif
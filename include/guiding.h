@@ -0,0 +1,126 @@
+#ifndef GUIDING_H
+#define GUIDING_H
+
+#include "color.h"
+#include "bvh.h"
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+// PATH GUIDING //
+// learns from which directions light arrives while rendering, so diffuse bounces can be sent there more often.
+// space is split by a binary tree (halved along x, y and z in turn) and every leaf holds a quadtree over
+// directions (spatial-directional tree, "SD-tree") //
+
+
+// directions are mapped to the unit square by (cos theta, phi), which keeps areas, so every level of the
+// quadtree splits the sphere into cells of equal solid angle
+class DirectionTree {
+public:
+    DirectionTree() : nodes(1) {}
+    DirectionTree(const DirectionTree& other);
+    DirectionTree& operator=(const DirectionTree& other);
+
+    // adds value to the cells containing the direction (thread safe)
+    void record(const vec3& direction, float value);
+
+    // direction drawn proportional to the recorded values, pdf is the density of that over the sphere
+    vec3 sample() const;
+    double pdf(const vec3& direction) const;
+
+    float get_total() const;
+    uint32_t get_sample_count() const { return sample_count.load(); }
+    size_t memory_size() const { return nodes.size() * sizeof(Node); }
+
+    // tree for the next iteration: cells holding more than subdivide_fraction of the total are split
+    // (at most one level deeper than this tree), the values are carried over
+    DirectionTree refined(float subdivide_fraction, int max_depth) const;
+    void clear_values(); // keeps the cells
+    void set_sample_count(uint32_t count) { sample_count = count; }
+
+private:
+    struct Node {
+        std::atomic<float> values[4];   // sum of the recorded values per quadrant
+        int children[4] = {0, 0, 0, 0}; // 0 = the quadrant is a leaf (the root is never a child)
+
+        Node();
+        Node(const Node& other);
+        Node& operator=(const Node& other);
+    };
+
+    std::vector<Node> nodes;
+    std::atomic<uint32_t> sample_count{0};
+};
+
+
+// the guide trains in iterations: during one iteration paths sample from the trees of the last iteration
+// and record into new ones, refine() then turns the recorded trees into the ones that are sampled next
+class PathGuide {
+public:
+    PathGuide(const AABB& scene_bounds);
+
+    // leaf of the spatial tree that contains the position
+    int get_leaf(const point3& position) const;
+    const DirectionTree& get_sampling_tree(int leaf) const { return leaves[leaf].sampling; }
+    void record(int leaf, const vec3& direction, float value) { leaves[leaf].recording.record(direction, value); }
+
+    // ends a training iteration (not thread safe, call it between passes)
+    void refine();
+    bool is_training() const { return training; }
+    void stop_training() { training = false; }
+
+    int get_iteration() const { return iteration; }
+    size_t memory_size() const;
+
+    // splitting of space and directions
+    uint32_t spatial_threshold = 4000; // leaves with more samples than this are split
+    int max_spatial_depth = 24;
+    float direction_threshold = 0.01f; // direction cells with more of the energy than this are split
+    int max_direction_depth = 16;
+
+private:
+    struct SpatialNode {
+        int depth;        // split axis is depth % 3
+        int children = 0; // left child (right is the one after), 0 = leaf
+        int leaf;         // index into leaves
+    };
+    struct Leaf {
+        DirectionTree sampling;
+        DirectionTree recording;
+    };
+
+    AABB bounds;
+    std::vector<SpatialNode> nodes;
+    std::vector<Leaf> leaves;
+    int iteration = 0;
+    bool training = true;
+};
+
+
+// incident radiance at the guided vertices of one path, recorded into the guide when the path ends
+class GuidePath {
+public:
+    // a guided bounce leaves from here (pdf is the density the direction was drawn with)
+    void add_vertex(int leaf, const vec3& direction, double pdf);
+    // light that the last ray found, before the bounce weight of its hit is applied
+    void add_emission(const color& emission);
+    void add_bounce_weight(const color& weight);
+
+    void record(PathGuide& guide) const;
+
+private:
+    struct Vertex {
+        int leaf;
+        vec3 direction;
+        double pdf;
+        color weight;   // product of the bounce weights after this vertex
+        color radiance; // light that arrived at this vertex so far
+    };
+
+    static const int max_vertices = 4; // deeper vertices are not recorded
+    Vertex vertices[max_vertices];
+    int vertex_count = 0;
+};
+
+#endif
@@ -24,10 +24,20 @@ inline double degrees_to_radians(double degrees) {
     return degrees * pi / 180.0;
 }
 
+// every render thread gets its own generator, so threads never share state
+inline std::mt19937& random_generator() {
+    thread_local std::mt19937 generator;
+    return generator;
+}
+
+// reseed the generator of the calling thread (done per tile so the image does not depend on the thread count)
+inline void seed_random(unsigned int seed) {
+    random_generator().seed(seed);
+}
+
 inline double random_double() {
-    static std::uniform_real_distribution<double> distribution(0.0, 1.0);
-    static std::mt19937 generator;
-    return distribution(generator);
+    thread_local std::uniform_real_distribution<double> distribution(0.0, 1.0);
+    return distribution(random_generator());
 }
 
 // Common Headers
@@ -37,5 +47,6 @@ inline double random_double() {
 #include "vec3.h"
 #include "mesh.h"
 #include "scene.h"
+#include "ordering.h"
 
 #endif
@@ -2,15 +2,80 @@
 #define MATERIAL_H
 
 #include "color.h"
+#include "texture.h"
 #include <memory>
+#include <filesystem>
 #include <fstream>
 #include <iostream>
 #include <sstream>
+#include <map>
+#include <mutex>
+#include <string>
 
 
 class Material {
 public:
-	Material(const std::string& filename, const std::string& material_name) {	
+	// material from memory (no mtl file)
+	Material(const color& diffuse, const color& emission = color(0,0,0), float roughness = 0,
+			 std::shared_ptr<Texture> diffuse_texture = nullptr)
+		: roughness(roughness), diffuse(diffuse), emission(emission), diffuse_texture(diffuse_texture) {}
+
+	Material(const std::string& filename, const std::string& material_name) : filename(filename) {
+		load(filename, material_name);
+	}
+
+	// reads the mtl file again if it changed since it was loaded (only between renders, nothing is locked).
+	// returns true if the material changed
+	bool reload_if_changed() {
+		std::error_code error;
+		if (filename.empty() || std::filesystem::last_write_time(filename, error) <= loaded_time || error) {
+			return false;
+		}
+		std::string name = material_name;
+		*this = Material(filename, name);
+		return true;
+	}
+
+	color get_color() const {
+		return diffuse;
+    }
+
+	// diffuse color multiplied with the texture (if the material has one)
+	color get_color(double u, double v, double level) const {
+		if (!diffuse_texture) {
+			return diffuse;
+		}
+		return diffuse * diffuse_texture->sample(u, v, level);
+    }
+
+	const Texture* get_diffuse_texture() const {
+		return diffuse_texture.get();
+	}
+
+	color get_emission() const {
+		return emission;
+	}
+
+	float get_roughness() const {
+		return roughness;
+	}
+
+private:
+	std::string filename; // empty for materials from memory
+	std::filesystem::file_time_type loaded_time;
+    std::string material_name;
+	float roughness = 0;
+	color ambient;
+	color diffuse;
+	color specular;
+	color emission;
+	std::shared_ptr<Texture> diffuse_texture;
+
+	void load(const std::string& filename, const std::string& material_name) {
+		std::error_code error;
+		loaded_time = std::filesystem::last_write_time(filename, error);
+		this->material_name = material_name;
+
 		std::ifstream mtl(filename);
 		if (!mtl.is_open()) {
 		    std::cerr << "Failed to load material from: " << filename << "\n";
@@ -60,30 +125,36 @@ public:
 				stream >> r >> g >> b;
 				this->emission = color(r,g,b);
 		    }
+		    else if (prefix == "map_Kd") { // diffuse texture (path relative to the mtl file)
+				std::string texture_file;
+				stream >> texture_file;
+				std::filesystem::path texture_path = std::filesystem::path(filename).parent_path() / texture_file;
+				diffuse_texture = std::make_shared<Texture>(texture_path.string());
+				if (!diffuse_texture->is_valid()) {
+					diffuse_texture = nullptr;
+				}
+		    }
         }
 		mtl.close();
     }
+};
 
 
-	color get_color() const {
-		return diffuse;
-    }
-
-	color get_emission() const {
-		return emission;
-	}
-
-	float get_roughness() const {
-		return roughness;
+// makes sure every material of a scene is only loaded once, even when meshes load on several threads
+class MaterialLibrary {
+public:
+	std::shared_ptr<Material> get(const std::string& filename, const std::string& material_name) {
+		std::lock_guard<std::mutex> lock(library_mutex);
+		std::shared_ptr<Material>& material = materials[{filename, material_name}];
+		if (!material) {
+			material = std::make_shared<Material>(filename, material_name);
+		}
+		return material;
 	}
 
 private:
-    std::string material_name;
-	float roughness;
-	color ambient;
-	color diffuse;
-	color specular;
-	color emission;
+	std::mutex library_mutex;
+	std::map<std::pair<std::string, std::string>, std::shared_ptr<Material>> materials;
 };
 
 #endif
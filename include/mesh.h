@@ -3,19 +3,26 @@
 
 #include "ray.h"
 #include "material.h"
+#include "bvh.h"
 
 #include <vector>
 #include <string>
 #include <limits>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <filesystem>
 
 struct Face {
     int face_vertices[3];
+    int face_uvs[3] = {-1, -1, -1}; // index into the texture coordinates (-1 if the face has none)
 };
 
 struct RayHit {
     double hit_time;
 	int face_id;
 	class Hittable* hit_object = nullptr; // pointer to the hit object
+	int lod = 0; // detail level of the mesh that face_id belongs to (0 = full resolution)
 };
 
 struct BoundHit {
@@ -31,40 +38,153 @@ public:
 };
 
 
+// one version of the surface of a mesh: the full resolution or a simplified level of detail
+struct MeshLevel {
+    std::vector<point3> vertices;     // list for vertices
+    std::vector<Face> faces;		  // list for faces
+    std::vector<vec3> vertex_normals; // list for vertex normals
+	BVH face_bvh;                     // hierarchy over the faces
+	double error = 0;                 // how far the surface may be from the full resolution one (world units)
+
+	size_t memory_size() const;
+};
+
+// everything of a mesh that is only needed once a ray reaches its bounding box
+struct MeshGeometry : MeshLevel {
+    std::vector<vec3> texture_coordinates; // list for uvs (z is unused), shared by all levels
+	std::vector<MeshLevel> lods;           // coarser and coarser levels (lods[0] is level 1), empty for small meshes
+
+	const MeshLevel& get_level(int lod) const { return lod == 0 ? *this : lods[lod - 1]; }
+	size_t memory_size() const;
+};
+
+
 class Mesh : public Hittable { // Mesh is a subclass of Hittable
 public:
-    Mesh(const std::string& filename);
-	
-	bool smooth_shading;
+	// materials are shared through the library if given. a lazy mesh only reads its bounds and material
+	// from the header file next to the obj (<filename>.bounds, written on the first run) and loads
+	// the geometry when the first ray hits the bounds (from <filename>.geometry after the first time).
+	// detail_levels builds the simplified levels of detail along with the geometry (see hit)
+    Mesh(const std::string& filename, MaterialLibrary* materials = nullptr, bool lazy = false, bool detail_levels = false);
+
+	// mesh from memory (no obj file)
+	Mesh(std::vector<point3> vertices, std::vector<Face> faces, std::shared_ptr<Material> material,
+		 bool smooth_shading = false, std::vector<vec3> texture_coordinates = {}, bool detail_levels = false);
+
+	bool smooth_shading = false;
 	std::string material_name;
 	std::string object_name;
 
-    virtual ~Mesh() = default; // have to find out what virtual and the ~ mean
+    virtual ~Mesh(); // have to find out what virtual and the ~ mean
     virtual RayHit hit(const ray& render_ray) override; // have to find out what the override means
+	// hit against the coarsest level of detail whose error is at most max_lod_error (full detail if the
+	// mesh has no levels of detail)
+	RayHit hit(const ray& render_ray, double max_lod_error);
+	RayHit hit_level(const ray& render_ray, int lod); // hit against one level of detail (0 = full detail)
     virtual bool bound_hit(const ray& render_ray) override;
-    vec3 get_normal_vector(const int& face_index, const ray& render_ray) const;
+	// hits of the packet rays in the mask that are closer than their packet.closest_times (which are lowered)
+	void hit_packet(RayPacket& packet, uint64_t ray_mask, RayHit* hits) const;
+    vec3 get_normal_vector(const int& face_index, const ray& render_ray, int lod = 0) const;
+	point3 get_bounds_min() const { return bounding_box_min; }
+	point3 get_bounds_max() const { return bounding_box_max; }
 
 	// material properties
 	color get_color() const; // returns diffuse color
+	color get_color(const int& face_index, const ray& render_ray, const double& footprint, int lod = 0) const; // textured diffuse color, footprint is the ray width at the hit
+	color get_color(const int& face_index, double u, double v, const double& footprint, int lod = 0) const; // same at a known position in the face
+	void get_barycentric(const int& face_index, const ray& render_ray, double& u, double& v, int lod = 0) const;
     color get_emission() const;
 	float get_roughness() const;
+	Material* get_material() const { return material_pointer.get(); }
 	vec3 get_specular_direction(const ray& render_ray_direction, const vec3& face_normal);
 	vec3 get_diffuse_direction(const vec3& face_normal);
 
+	// lazy loading
+	bool is_lazy() const { return lazy; }
+	bool is_resident() const { return std::atomic_load(&geometry) != nullptr; }
+
+	// reloading (meshes from memory have no file and never change)
+	const std::string& get_filename() const { return filename; }
+	bool has_detail_levels() const { return detail_levels; }
+	bool obj_changed() const; // the obj file changed since the mesh was loaded
+
 
 private:
-    std::vector<point3> vertices;     // list for vertices
-    std::vector<Face> faces;		  // list for faces
-    std::vector<vec3> vertex_normals; // list for vertex normals
+	std::string filename;
+	std::string mtl_file;
+	std::filesystem::file_time_type loaded_time; // of the obj file
+	bool lazy;
+	bool detail_levels;
+	mutable std::shared_ptr<const MeshGeometry> geometry; // always there for normal meshes, loaded on demand for lazy ones
+	mutable std::mutex load_mutex;                // only rays that need this mesh wait while it loads
+	mutable std::atomic<int64_t> last_used{0};    // epoch of the geometry cache the mesh was last hit in (for the eviction of cold meshes)
 	std::shared_ptr<Material> material_pointer;
 	point3 bounding_box_max;
 	point3 bounding_box_min;
-    
-    bool load_obj(const std::string& filename);
-    void calculate_vertex_normals();
-    double get_ray_mesh_intersection(const ray& render_ray, const point3 triangle[3]) const; 
-	void get_bounding_box();
+
+	// what the obj tells besides the geometry
+	struct ObjHeader {
+		std::string object_name, mtl_file, material_name;
+		bool smooth_shading = false;
+		AABB bounds;
+		size_t face_count = 0;
+	};
+	// without geometry only the header is read. parse_obj touches no members, so a lazy mesh can load its
+	// geometry while other threads use the mesh, load_obj also takes over the header (constructor only)
+	static bool parse_obj(const std::string& filename, MeshGeometry* geometry, ObjHeader& header);
+    bool load_obj(const std::string& filename, MeshGeometry* geometry);
+	static constexpr int lod_min_faces = 32; // the coarsest level of detail keeps at least this many faces
+
+    static void calculate_vertex_normals(MeshLevel& level);
+    double get_ray_mesh_intersection(const ray& render_ray, const point3 triangle[3]) const;
+    RayHit hit_level(const ray& render_ray, const MeshLevel& level, int lod) const;
+    void get_barycentric(const MeshLevel& level, const int& face_index, const ray& render_ray, double& u, double& v) const;
+	void get_bounding_box(const MeshGeometry& geometry);
+	static void build_bvh(MeshLevel& level);
+	static void build_lods(MeshGeometry& geometry); // simplified levels with their normals and hierarchies
+
+	std::shared_ptr<const MeshGeometry> load_geometry() const;
+	std::shared_ptr<const MeshGeometry> acquire_geometry() const;
+	const MeshGeometry& get_geometry(std::shared_ptr<const MeshGeometry>& pinned) const; // lazy meshes are loaded first and pinned
+	bool read_geometry_cache(const std::string& cache_file, MeshGeometry& geometry) const;
+	void write_geometry_cache(const std::string& cache_file, const MeshGeometry& geometry) const;
+	bool read_header(const std::string& header_file);
+	void write_header(const std::string& header_file, size_t face_count) const;
+
+	friend class GeometryCache;
 };
 
-#endif
 
+// keeps the loaded geometry of all lazy meshes below a memory budget by unloading the meshes
+// that were not hit for the longest time (rays that still use an unloaded geometry keep it alive).
+// time is counted in epochs: the renderer starts a new one for every tile, so a mesh is stamped
+// once per tile and not on every ray
+class GeometryCache {
+public:
+	static GeometryCache& global();
+
+	void set_budget(size_t bytes);
+	size_t get_memory_usage() const;
+
+	void loaded(const Mesh* mesh, size_t bytes);
+	void forget(const Mesh* mesh);
+
+	void next_epoch() { epoch++; }
+	int64_t get_epoch() const { return epoch.load(std::memory_order_relaxed); }
+
+private:
+	struct Entry {
+		const Mesh* mesh;
+		size_t bytes;
+	};
+
+	mutable std::mutex cache_mutex;
+	std::vector<Entry> resident;
+	size_t memory_usage = 0;
+	size_t budget = size_t(1) << 30; // 1 GB
+	std::atomic<int64_t> epoch{0};
+
+	void evict(const Mesh* keep);
+};
+
+#endif
@@ -0,0 +1,118 @@
+#ifndef ORDERING_H
+#define ORDERING_H
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+// SPACE FILLING CURVES //
+// used to order work so that neighbouring work items touch the same geometry //
+
+
+enum class TileOrder {
+    scanline, // row by row (old behaviour)
+    morton,   // z-order curve
+    hilbert   // hilbert curve (no jumps between neighbouring tiles)
+};
+
+struct Tile {
+    int index;    // position in the row-major tile grid (used as random seed)
+    int x0, y0;   // first pixel (inclusive)
+    int x1, y1;   // last pixel (exclusive)
+};
+
+
+// spread the lower 16 bits so that there is a zero bit between each of them
+inline uint32_t spread_bits_2d(uint32_t value) {
+    value &= 0x0000ffff;
+    value = (value | (value << 8)) & 0x00ff00ff;
+    value = (value | (value << 4)) & 0x0f0f0f0f;
+    value = (value | (value << 2)) & 0x33333333;
+    value = (value | (value << 1)) & 0x55555555;
+    return value;
+}
+
+// spread the lower 10 bits so that there are two zero bits between each of them
+inline uint32_t spread_bits_3d(uint32_t value) {
+    value &= 0x000003ff;
+    value = (value | (value << 16)) & 0x030000ff;
+    value = (value | (value << 8)) & 0x0300f00f;
+    value = (value | (value << 4)) & 0x030c30c3;
+    value = (value | (value << 2)) & 0x09249249;
+    return value;
+}
+
+inline uint32_t morton_2d(uint32_t x, uint32_t y) {
+    return spread_bits_2d(x) | (spread_bits_2d(y) << 1);
+}
+
+inline uint32_t morton_3d(uint32_t x, uint32_t y, uint32_t z) {
+    return spread_bits_3d(x) | (spread_bits_3d(y) << 1) | (spread_bits_3d(z) << 2);
+}
+
+// distance along the hilbert curve of a grid with side n (n has to be a power of two)
+inline uint32_t hilbert_2d(uint32_t n, uint32_t x, uint32_t y) {
+    uint32_t distance = 0;
+    for (uint32_t s = n / 2; s > 0; s /= 2) {
+        uint32_t rx = (x & s) > 0;
+        uint32_t ry = (y & s) > 0;
+        distance += s * s * ((3 * rx) ^ ry);
+
+        // rotate the quadrant so the curve stays connected
+        if (ry == 0) {
+            if (rx == 1) {
+                x = s - 1 - x;
+                y = s - 1 - y;
+            }
+            std::swap(x, y);
+        }
+    }
+    return distance;
+}
+
+
+// split the image into tiles and sort them along the chosen curve
+inline std::vector<Tile> make_tiles(int image_width, int image_height, int tile_size, TileOrder order) {
+    int tiles_x = (image_width + tile_size - 1) / tile_size;
+    int tiles_y = (image_height + tile_size - 1) / tile_size;
+
+    uint32_t grid_size = 1; // hilbert needs a power of two grid
+    while (grid_size < (uint32_t)std::max(tiles_x, tiles_y)) {
+        grid_size *= 2;
+    }
+
+    std::vector<std::pair<uint32_t, Tile>> keyed_tiles;
+    keyed_tiles.reserve(tiles_x * tiles_y);
+
+    for (int ty = 0; ty < tiles_y; ty++) {
+        for (int tx = 0; tx < tiles_x; tx++) {
+            Tile tile;
+            tile.index = ty * tiles_x + tx;
+            tile.x0 = tx * tile_size;
+            tile.y0 = ty * tile_size;
+            tile.x1 = std::min(tile.x0 + tile_size, image_width);
+            tile.y1 = std::min(tile.y0 + tile_size, image_height);
+
+            uint32_t key = tile.index;
+            if (order == TileOrder::morton) {
+                key = morton_2d(tx, ty);
+            }
+            else if (order == TileOrder::hilbert) {
+                key = hilbert_2d(grid_size, tx, ty);
+            }
+            keyed_tiles.push_back({key, tile});
+        }
+    }
+
+    std::sort(keyed_tiles.begin(), keyed_tiles.end(),
+              [](const auto& a, const auto& b) { return a.first < b.first; });
+
+    std::vector<Tile> tiles;
+    tiles.reserve(keyed_tiles.size());
+    for (const auto& keyed_tile : keyed_tiles) {
+        tiles.push_back(keyed_tile.second);
+    }
+    return tiles;
+}
+
+#endif
@@ -0,0 +1,193 @@
+#ifndef RENDERER_H
+#define RENDERER_H
+
+#include "leo-raytracer.h"
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// RENDERER //
+// everything needed to render a scene into memory, main.cc is just one client of this //
+
+
+// where the camera rays of a pixel go through it
+enum class PixelSampling {
+    center,     // all through the middle (no antialiasing)
+    jittered,   // random positions
+    stratified, // one random position per cell of a grid over the pixel (per row and column if the count is not square)
+};
+
+// how the samples near a pixel are weighted when they are added up (pixel filter)
+enum class PixelFilter {
+    box,             // samples inside the pixel count equally
+    tent,            // falls off linearly to the radius
+    blackman_harris, // smooth bell, sharper than a gaussian of the same width
+};
+
+// positions on the image are in pixels from the top left corner, pixel (i, j) covers [i, i + 1) x [j, j + 1)
+class Camera {
+public:
+    Camera(const point3& position = point3(0, 0, 5), const point3& look_at = point3(0, 0, 0), const vec3& up = vec3(0, 1, 0)) {
+        look(position, look_at, up);
+    }
+
+    double image_plane_distance = 3; // rays start on the image plane (so nothing between it and the camera is hit)
+    double image_plane_width = 4;    // world units, the height follows from the image aspect ratio
+    PixelSampling pixel_sampling = PixelSampling::stratified;
+
+    // places the camera, the directions of the image plane are computed here once and not for every ray
+    void look(const point3& new_position, const point3& new_look_at, const vec3& new_up = vec3(0, 1, 0));
+    const point3& get_position() const { return position; }
+    const point3& get_look_at() const { return look_at; }
+    const vec3& get_up() const { return up; }
+
+    ray get_ray(double x, double y, int image_width, int image_height) const;
+
+    // adds the positions (x, y, 0) of count rays through pixel (i, j) (uses random_double() unless centered)
+    void sample_pixel(int i, int j, int count, std::vector<vec3>& positions) const;
+
+private:
+    point3 position;
+    point3 look_at;
+    vec3 up;
+    vec3 forward, right, image_up; // follow from the three above (see look)
+};
+
+struct RenderSettings {
+    int image_width = 480;
+    int image_height = 480;
+
+    int primary_samples = 1; // camera rays per pixel and pass (antialiasing)
+    int samples = 3;         // paths per camera ray (they share its first hit)
+    int max_bounces = 3;
+
+    // pixel filter, samples are added to every pixel within filter_radius (in pixels) of them.
+    // 0 = the usual radius of the filter (box 0.5, tent 1, blackman harris 2)
+    PixelFilter pixel_filter = PixelFilter::box;
+    double filter_radius = 0;
+
+    // work scheduling
+    int tile_size = 16;
+    TileOrder tile_order = TileOrder::hilbert;
+    bool sort_secondary_rays = true; // trace bounce rays in sorted batches per tile
+    int threads = 0;                 // 0 = one per core
+    bool primary_ray_packets = true; // trace the camera rays of every 8x8 pixel block together
+
+    // progressive rendering: coarse passes first (resolution doubles each pass, pixels that are traced
+    // already are skipped), then the samples per pixel double each pass until target_samples is reached
+    // or the time budget is used up
+    bool progressive = false;
+    int coarse_scale = 8;     // first pass renders one pixel per 8x8 block (power of two, at most tile_size)
+    int target_samples = 64;  // paths per camera ray of all passes together
+    double time_budget = 0;   // seconds, 0 = no limit
+
+    // path guiding: the guide learns where light comes from during the first passes and sends the diffuse
+    // bounces of later passes there more often. without progressive the samples are split into passes
+    // of 1, 2, 4, ... samples per camera ray for that (or the camera rays per pixel if samples is 1)
+    bool path_guiding = false;
+    int guide_training_passes = 4; // full resolution passes that train the guide, the later ones only use it
+    double guide_fraction = 0.5;   // share of the diffuse bounces that follow the guide
+
+    // levels of detail: bounce rays from lod_start_bounce on intersect simplified meshes once the
+    // footprint of the ray is wider than the error of the simplification (only meshes that were
+    // loaded with their levels of detail, see MeshScene::load)
+    bool mesh_lod = false;
+    int lod_start_bounce = 1;
+
+    // path recording: render() keeps the hits of every path, so render_materials() can shade them again
+    // after material edits without tracing. recording stops (and the paths are dropped) above the budget
+    bool record_paths = false;
+    size_t path_cache_budget = size_t(1) << 30; // bytes
+};
+
+// memory owned by the caller, row by row from the top left pixel
+struct Framebuffer {
+    color* pixels;
+    int width;
+    int height;
+};
+
+// called from the render threads, so they have to be thread safe
+struct RenderCallbacks {
+    std::function<void(const Tile& tile, int pass)> tile_done;
+    std::function<void(int pass, int total_samples)> pass_done; // framebuffer is up to date (total_samples is 0 during coarse passes)
+};
+
+
+class Renderer {
+public:
+    Renderer(const MeshScene& scene) : scene(scene) {}
+
+    Camera camera;
+    RenderSettings settings;
+
+    // renders into the framebuffer (has to match the image size of the settings, else nothing is rendered).
+    // returns false if the render was cancelled or ran out of time, the framebuffer then holds the best image so far
+    bool render(Framebuffer& framebuffer, const RenderCallbacks& callbacks = RenderCallbacks(),
+                const std::atomic<bool>* cancel = nullptr);
+
+    // renders again with the current materials (see MeshScene::reload_materials) along the paths that the
+    // last render() recorded, only tiles whose paths met a changed roughness are traced again. returns false
+    // without touching the framebuffer if there are no recorded paths (or the framebuffer does not match the
+    // image size). the camera and the settings have to be the same as in that render (otherwise call render()).
+    // if the geometry changed since (an obj file or MeshScene::reload_geometry) the paths are dropped and it
+    // returns false as well. cancel and the time budget stop it like render(), the paths are kept for the next call
+    bool render_materials(Framebuffer& framebuffer, const RenderCallbacks& callbacks = RenderCallbacks(),
+                          const std::atomic<bool>* cancel = nullptr);
+
+    ray get_camera_ray(int i, int j) const; // through the middle of the pixel
+
+    const PathGuide* get_guide() const { return guide.get(); }
+    bool has_recorded_paths() const { return paths_recorded; }
+    size_t get_path_cache_size() const { return path_cache_size; } // bytes
+    void clear_path_cache();
+
+private:
+    const MeshScene& scene;
+    std::unique_ptr<PathGuide> guide; // only while path guiding is on
+    TraceSettings trace_settings;     // of the last render() (render_materials traces stale tiles with them)
+
+    // a camera ray through pixel at the image position (x, y)
+    struct PixelSample {
+        int pixel;
+        double x, y;
+    };
+
+    // filtered sums per pixel (the framebuffer only holds the average), pixels near a tile border get samples
+    // of the neighbouring tile as well, so the sums are only changed while add_mutex is held
+    std::vector<color> color_sum;
+    std::vector<double> weight_sum;
+    std::vector<int> sample_count; // paths started in the pixel itself
+    std::mutex add_mutex;
+
+    // the paths one render pass traced in one tile
+    struct RecordedTile {
+        Tile tile;
+        int pass;
+        int scale;
+        int pass_samples;
+        int primary_samples;
+        std::vector<PixelSample> samples;
+        PathRecord paths; // pass_samples paths per sample
+    };
+    std::vector<RecordedTile> recorded_tiles; // in the order of the passes
+    std::mutex record_mutex;
+    size_t path_cache_size = 0;
+    std::atomic<bool> paths_recorded{false}; // false while there is nothing to replay (or the budget was exceeded)
+    size_t recorded_geometry_version = 0;    // of the scene the paths were recorded in
+
+    void render_pass_tile(Framebuffer& framebuffer, const Tile& tile, size_t tile_count, int pass, int scale, int pass_samples,
+                          int primary_samples);
+    void add_tile_samples(Framebuffer& framebuffer, const Tile& tile, int scale, int pass_samples,
+                          const std::vector<PixelSample>& tile_samples, const std::vector<color>& sample_colors);
+    double get_filter_radius() const;
+    bool matches_image_size(const Framebuffer& framebuffer) const; // complains if not
+    void keep_recorded_tile(RecordedTile recorded);
+    void trace_primary_packets(const Tile& tile, int scale, const std::vector<PixelSample>& tile_samples, const std::vector<ray>& tile_rays,
+                               std::vector<RayHit>& primary_hits) const;
+};
+
+#endif
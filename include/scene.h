@@ -1,15 +1,220 @@
+#ifndef SCENE_H
+#define SCENE_H
+
 #include <vector>
 #include <memory>
+#include <algorithm>
+#include <cstdint>
+#include <cmath>
+#include <atomic>
+#include <string>
+#include <thread>
 #include "mesh.h"
 #include "ray.h"
+#include "bvh.h"
+#include "ordering.h"
+#include "guiding.h"
+
+// a bounce ray that is still alive, used when secondary rays are traced in sorted batches
+struct PathState {
+    ray current_ray;
+    color throughput;
+    double path_length; // distance travelled so far (for the texture footprint)
+    int pixel_index;   // which pixel of the batch the path belongs to
+    uint32_t sort_key; // origin cell and direction octant
+    int guide_path;    // index of the path in the guide recording (-1 if the guide is not recording)
+    const Mesh* origin_mesh; // mesh the current ray starts on
+    int origin_lod;          // and the level of detail of it that was hit
+    int record_path;   // index of the path in the path record (-1 if paths are not recorded)
+};
+
+// a bounce direction and what path guiding needs to know about it
+struct BounceSample {
+    vec3 direction;
+    double weight = 1;       // corrects the throughput when the diffuse part was not cosine sampled
+    vec3 diffuse_direction;  // the part of the bounce that is guided
+    double pdf = 0;          // density the diffuse direction was drawn with, 0 if the bounce is not guided
+    int guide_leaf = -1;
+};
+
+// what shading needs to know about one hit of a recorded path, so it can be shaded again without tracing
+struct PathVertex {
+    const Mesh* mesh;
+    int face_id;
+    int lod;
+    float u, v;       // position in the face (for textures)
+    float footprint;  // ray width at the hit (texture mip level)
+    float weight;     // weight of the bounce that left the hit
+    float roughness;  // the bounce direction depended on it, the rest of the path is wrong once it changes
+};
+
+// hits of recorded paths in order, path k has the vertices from path_starts[k] up to the start of the next path
+struct PathRecord {
+    std::vector<uint32_t> path_starts;
+    std::vector<PathVertex> vertices;
+
+    size_t path_count() const { return path_starts.size(); }
+    void begin_path() { path_starts.push_back(uint32_t(vertices.size())); }
+    size_t memory_size() const { return path_starts.capacity() * sizeof(uint32_t) + vertices.capacity() * sizeof(PathVertex); }
+
+    // light of path k with the current materials (the same sum trace_path builds while it traces)
+    color shade(size_t k) const {
+        size_t end = k + 1 < path_starts.size() ? path_starts[k + 1] : vertices.size();
+        color sample_color(0, 0, 0);
+        color throughput(1, 1, 1);
+        for (size_t i = path_starts[k]; i < end; i++) {
+            const PathVertex& vertex = vertices[i];
+            sample_color += throughput * vertex.mesh->get_emission();
+            throughput = throughput * vertex.mesh->get_color(vertex.face_id, vertex.u, vertex.v, vertex.footprint, vertex.lod) * vertex.weight;
+        }
+        return sample_color;
+    }
+
+    // true if a roughness changed since the paths were traced (their directions would be different now)
+    bool is_stale() const {
+        for (const PathVertex& vertex : vertices) {
+            if (vertex.mesh->get_roughness() != vertex.roughness) {
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+// what one render decides about its paths. the scene itself is not changed by tracing, so several
+// renders (each with its own settings) can share it
+struct TraceSettings {
+	// texture filtering: angle covered by one pixel, and how many mip levels every bounce adds
+	double pixel_spread = 0;
+	int texture_bounce_bias = 2;
+
+	// path guiding: if set, this fraction of the diffuse bounces follows the learned light directions
+	PathGuide* guide = nullptr;
+	double guide_fraction = 0.5;
+
+	// levels of detail: from bounce lod_start_bounce on, meshes are intersected at the coarsest level
+	// whose error is below the footprint of the ray (the same width that picks the texture mip level)
+	bool use_lod = false;
+	int lod_start_bounce = 1;
+};
 
 class MeshScene {
 public:
+	AABB get_bounds() const {
+		AABB bounds;
+		bounds.grow(bounds_min);
+		bounds.grow(bounds_max);
+		return bounds;
+	}
+
     // add mesh to the scene
     void add(const std::shared_ptr<Mesh>& mesh) {
         meshes.push_back(mesh);
+		geometry_version++;
+
+		// grow the scene bounds (used to build the sort keys of secondary rays)
+		for (int i = 0; i < 3; i++) {
+			bounds_min[i] = std::min(bounds_min[i], mesh->get_bounds_min()[i]);
+			bounds_max[i] = std::max(bounds_max[i], mesh->get_bounds_max()[i]);
+		}
+		mesh_bvh.nodes.clear(); // top level has to be rebuilt (see build)
     }
 
+	// load all meshes at once: every thread takes the next file, materials are shared between
+	// the meshes and the hierarchy of each mesh is built right after it is loaded.
+	// lazy meshes only read their bounds here and load the rest when a ray first hits them.
+	// detail_levels builds the levels of detail of the meshes (needed for RenderSettings::mesh_lod)
+	void load(const std::vector<std::string>& filenames, int threads = std::thread::hardware_concurrency(), bool lazy = false,
+			  bool detail_levels = false) {
+		MaterialLibrary materials;
+		std::vector<std::shared_ptr<Mesh>> loaded(filenames.size());
+		std::atomic<size_t> next_file(0);
+
+		auto load_worker = [&]() {
+			for (size_t f = next_file++; f < filenames.size(); f = next_file++) {
+				loaded[f] = std::make_shared<Mesh>(filenames[f], &materials, lazy, detail_levels);
+			}
+		};
+
+		std::vector<std::thread> workers;
+		for (int t = 1; t < std::min<int>(threads, filenames.size()); t++) {
+			workers.emplace_back(load_worker);
+		}
+		load_worker();
+		for (std::thread& worker : workers) {
+			worker.join();
+		}
+
+		for (const auto& mesh : loaded) { // keep the order of the file list
+			add(mesh);
+		}
+		build();
+	}
+
+	// reads the mtl files that changed since they were loaded again, returns true if any material changed.
+	// geometry stays as it is (only call it between renders)
+	bool reload_materials() {
+		std::vector<Material*> materials;
+		for (const auto& mesh : meshes) {
+			if (std::find(materials.begin(), materials.end(), mesh->get_material()) == materials.end()) {
+				materials.push_back(mesh->get_material());
+			}
+		}
+		bool changed = false;
+		for (Material* material : materials) {
+			changed |= material->reload_if_changed();
+		}
+		return changed;
+	}
+
+	// true if the obj file of any mesh changed since the mesh was loaded
+	bool geometry_changed() const {
+		for (const auto& mesh : meshes) {
+			if (mesh->obj_changed()) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// loads the meshes whose obj file changed again (same lazy and detail level flags) and rebuilds the
+	// top level hierarchy, returns true if any changed. only call it between renders, paths recorded
+	// before point to the old meshes (see get_geometry_version)
+	bool reload_geometry() {
+		std::vector<std::shared_ptr<Mesh>> reloaded = meshes;
+		bool changed = false;
+		for (auto& mesh : reloaded) {
+			if (mesh->obj_changed()) {
+				mesh = std::make_shared<Mesh>(mesh->get_filename(), nullptr, mesh->is_lazy(), mesh->has_detail_levels());
+				changed = true;
+			}
+		}
+		if (!changed) {
+			return false;
+		}
+		meshes.clear();
+		bounds_min = point3(infinity, infinity, infinity);
+		bounds_max = point3(-infinity, -infinity, -infinity);
+		for (const auto& mesh : reloaded) {
+			add(mesh);
+		}
+		build();
+		return true;
+	}
+
+	// counts up whenever meshes are added or reloaded
+	size_t get_geometry_version() const { return geometry_version; }
+
+	// build the top level hierarchy over the bounding boxes of the meshes (after all meshes are added)
+	void build() {
+		std::vector<AABB> mesh_bounds(meshes.size());
+		for (size_t i = 0; i < meshes.size(); i++) {
+			mesh_bounds[i].grow(meshes[i]->get_bounds_min());
+			mesh_bounds[i].grow(meshes[i]->get_bounds_max());
+		}
+		mesh_bvh.build(mesh_bounds);
+	}
+
     // cast a ray and return the closest hit among all meshes in the scene
     RayHit hit(const ray& render_ray) const {
         RayHit closest_hit;
@@ -36,28 +241,101 @@ public:
         return closest_hit;
     }
 
+	// closest hit for path tracing (skips meshes whose bounding box is missed). with max_lod_error meshes
+	// may be intersected at a coarser level of detail, except origin_mesh (the mesh the ray starts on): it is
+	// intersected at origin_lod, the level the ray started on. any other level of it can lie on either side
+	// of the start point (up to the error of the levels) and the ray would hit its own mesh from the inside
+	RayHit trace_hit(const ray& render_ray, double max_lod_error = 0, const Mesh* origin_mesh = nullptr, int origin_lod = 0) const {
+		RayHit hit;
+		hit.hit_time = -1;  // no hit
+		hit.face_id = -1;
+		double closest_time = std::numeric_limits<double>::max();
+
+		auto test_mesh = [&](const std::shared_ptr<Mesh>& mesh, double& closest_time) {
+			if (!mesh->bound_hit(render_ray)) {
+				return;
+			}
+			RayHit temp_hit = mesh.get() == origin_mesh ? mesh->hit_level(render_ray, origin_lod) : mesh->hit(render_ray, max_lod_error);
+			if (temp_hit.hit_time > 0.0001 && temp_hit.hit_time < closest_time) {
+				closest_time = temp_hit.hit_time;
+				temp_hit.hit_object = mesh.get(); // record which object was hit
+				hit = temp_hit;
+			}
+		};
+
+		if (mesh_bvh.empty()) { // scene was not built, test every mesh
+			for (const auto& mesh : meshes) {
+				test_mesh(mesh, closest_time);
+			}
+			return hit;
+		}
+		mesh_bvh.traverse(render_ray, closest_time, [&](int mesh_index, double& closest_time) {
+			test_mesh(meshes[mesh_index], closest_time);
+		});
+		return hit;
+	}
+
+	// closest hits of a packet of coherent rays (camera rays of a pixel block), same result as trace_hit
+	// for every ray. nodes outside the frustum of the packet are skipped for all rays at once, meshes that
+	// only a few rays of the packet reach are traced ray by ray, and so is a packet without a frustum
+	void trace_packet(RayPacket& packet, RayHit* hits) const {
+		if (mesh_bvh.empty() || !packet.has_frustum) {
+			for (int r = 0; r < packet.size; r++) {
+				hits[r] = trace_hit(packet.rays[r]);
+			}
+			return;
+		}
+		for (int r = 0; r < packet.size; r++) {
+			hits[r].hit_time = -1;  // no hit
+			hits[r].face_id = -1;
+			hits[r].hit_object = nullptr;
+			packet.closest_times[r] = std::numeric_limits<double>::max();
+		}
+
+		mesh_bvh.traverse_packet(packet, packet.full_mask(), [&](int mesh_index, uint64_t ray_mask) {
+			const std::shared_ptr<Mesh>& mesh = meshes[mesh_index];
+			uint64_t bound_mask = 0;
+			int bound_count = 0;
+			for (int r = 0; r < packet.size; r++) {
+				if (((ray_mask >> r) & 1) && mesh->bound_hit(packet.rays[r])) {
+					bound_mask |= uint64_t(1) << r;
+					bound_count++;
+				}
+			}
+
+			if (bound_count >= min_packet_rays) {
+				mesh->hit_packet(packet, bound_mask, hits);
+				return;
+			}
+			for (int r = 0; r < packet.size; r++) { // packet diverged, single rays are cheaper
+				if (!((bound_mask >> r) & 1)) {
+					continue;
+				}
+				RayHit temp_hit = mesh->hit(packet.rays[r]);
+				if (temp_hit.hit_time > 0.0001 && temp_hit.hit_time < packet.closest_times[r]) {
+					packet.closest_times[r] = temp_hit.hit_time;
+					temp_hit.hit_object = mesh.get();
+					hits[r] = temp_hit;
+				}
+			}
+		});
+	}
+
 
 // have to clean up the names etc (error correction from chatgpt (only one line was wrong but he still changed many names)
-color trace_path(ray render_ray, const int& samples, const int& max_bounces) const {
+// known_primary_hit can be given if the camera ray was already traced (e.g. in a packet).
+// with record the hits of every sample are added to it as one path each
+color trace_path(ray render_ray, const int& samples, const int& max_bounces, const TraceSettings& trace,
+                 const RayHit* known_primary_hit = nullptr, PathRecord* record = nullptr) const {
     color final_color(0, 0, 0);
 
 	// first object hit
-    RayHit primary_hit;
-    primary_hit.hit_time = -1;  // no hit yet
-    double closest_time = std::numeric_limits<double>::max();
-    for (const auto& mesh : meshes) {
-        if (!mesh->bound_hit(render_ray)) {
-            continue;
-        }
-        RayHit temp_hit = mesh->hit(render_ray);
-        if (temp_hit.hit_time > 0.0001 && temp_hit.hit_time < closest_time) {
-            closest_time = temp_hit.hit_time;
-            temp_hit.hit_object = mesh.get(); // record which object was hit
-            primary_hit = temp_hit;
-        }
-    }
+    RayHit primary_hit = known_primary_hit ? *known_primary_hit : trace_hit(render_ray);
 
     if (primary_hit.hit_time <= 0.0001) {
+        for (int i = 0; record && i < samples; i++) {
+            record->begin_path(); // paths without hits
+        }
         return final_color;
     }
 
@@ -65,69 +343,289 @@ color trace_path(ray render_ray, const int& samples, const int& max_bounces) con
     point3 primary_hit_point = render_ray.at(primary_hit.hit_time);
     vec3 primary_normal = primary_mesh->get_normal_vector(primary_hit.face_id, render_ray);
 
-    float primary_roughness = primary_mesh->get_roughness();
     color primary_emission = primary_mesh->get_emission();
-    color primary_diffuse = primary_mesh->get_color();
+    color primary_diffuse = primary_mesh->get_color(primary_hit.face_id, render_ray, get_footprint(trace, primary_hit.hit_time, 0));
+    bool recording = trace.guide && trace.guide->is_training();
 
 	// subsequent bounce hits
     for (int i = 0; i < samples; i++) {
         color throughput(1, 1, 1);
         color sample_color(0, 0, 0);
+        GuidePath guide_path;
 
         sample_color += throughput * primary_emission;
-        throughput = throughput * primary_diffuse;
+        BounceSample bounce = sample_bounce(trace, primary_mesh, render_ray, primary_normal, primary_hit_point);
+        throughput = throughput * primary_diffuse * bounce.weight;
+        if (record) {
+            record->begin_path();
+            record->vertices.push_back(get_path_vertex(primary_mesh, primary_hit, render_ray, get_footprint(trace, primary_hit.hit_time, 0), bounce.weight));
+        }
+        if (recording && max_bounces > 1 && bounce.pdf > 0 && bounce.weight > 0) {
+            guide_path.add_vertex(bounce.guide_leaf, bounce.diffuse_direction, bounce.pdf);
+        }
 
-        vec3 primary_specular = primary_mesh->get_specular_direction(render_ray, primary_normal);
-        vec3 primary_diffuse_direction  = primary_mesh->get_diffuse_direction(primary_normal);
-        vec3 reflection_direction = lerp(primary_diffuse_direction, primary_specular, primary_roughness);
-        ray current_ray(primary_hit_point, reflection_direction);
+        ray current_ray(primary_hit_point, bounce.direction);
+        double path_length = primary_hit.hit_time;
+        const Mesh* origin_mesh = primary_mesh;
+        int origin_lod = primary_hit.lod;
 
-        for (int j = 1; j < max_bounces; j++) {
-            RayHit hit;
-            hit.hit_time = -1;  // no hit
-            double closest_hit = std::numeric_limits<double>::max();
-
-            for (const auto& mesh : meshes) {
-                if (!mesh->bound_hit(current_ray)) {
-                    continue;
-                }
-                RayHit temp_hit = mesh->hit(current_ray);
-                if (temp_hit.hit_time > 0.0001 && temp_hit.hit_time < closest_hit) {
-                    closest_hit = temp_hit.hit_time;
-                    temp_hit.hit_object = mesh.get();
-                    hit = temp_hit;
-                }
-            }
+        for (int j = 1; j < max_bounces && bounce.weight > 0; j++) {
+            RayHit hit = trace_hit(current_ray, get_lod_error(trace, path_length, j), origin_mesh, origin_lod);
 
             // if ray hits object, update the ray and throughput
             if (hit.hit_time > 0.0001) {
                 Mesh* hit_mesh = dynamic_cast<Mesh*>(hit.hit_object);
                 point3 hit_point = current_ray.at(hit.hit_time);
-                vec3 normal = hit_mesh->get_normal_vector(hit.face_id, current_ray);
-                color emission = hit_mesh->get_emission();
-                color diffuse = hit_mesh->get_color();
-                float roughness = hit_mesh->get_roughness();
+                vec3 normal = hit_mesh->get_normal_vector(hit.face_id, current_ray, hit.lod);
+                path_length += hit.hit_time;
+                origin_mesh = hit_mesh;
+                origin_lod = hit.lod;
 
+                color emission = hit_mesh->get_emission();
+                color surface_color = hit_mesh->get_color(hit.face_id, current_ray, get_footprint(trace, path_length, j), hit.lod);
                 sample_color += throughput * emission;
-                throughput = throughput * diffuse;
 
                 // compute new reflection vector
-                vec3 specular_direction = hit_mesh->get_specular_direction(current_ray, normal);
-                vec3 diffuse_direction = hit_mesh->get_diffuse_direction(normal);
-                vec3 reflection_direction = lerp(diffuse_direction, specular_direction, roughness);
-                current_ray = ray(hit_point, reflection_direction);
+                bounce = sample_bounce(trace, hit_mesh, current_ray, normal, hit_point);
+                throughput = throughput * surface_color * bounce.weight;
+                if (record) {
+                    record->vertices.push_back(get_path_vertex(hit_mesh, hit, current_ray, get_footprint(trace, path_length, j), bounce.weight));
+                }
+                current_ray = ray(hit_point, bounce.direction);
+
+                if (recording) {
+                    guide_path.add_emission(emission);
+                    guide_path.add_bounce_weight(surface_color * bounce.weight);
+                    if (j + 1 < max_bounces && bounce.pdf > 0 && bounce.weight > 0) {
+                        guide_path.add_vertex(bounce.guide_leaf, bounce.diffuse_direction, bounce.pdf);
+                    }
+                }
             }
             else {
-                break; // no more hits 
+                break; // no more hits
             }
         }
+        if (recording) {
+            guide_path.record(*trace.guide);
+        }
         final_color += sample_color;
     }
     return final_color / samples;
 }
 
 
+	// same result as trace_path for a whole batch of pixels, but the bounce rays of all samples
+	// are collected and sorted by origin cell and direction octant before they are intersected,
+	// so rays that touch the same part of the scene are traced one after another.
+	// primary_hits can be given if they were already traced (e.g. in packets). with record the paths are
+	// added to it in the same order as trace_path adds them (all samples of the first pixel, then the next)
+	void trace_paths_sorted(const std::vector<ray>& primary_rays, const int& samples, const int& max_bounces,
+							const TraceSettings& trace, std::vector<color>& pixel_colors,
+							const std::vector<RayHit>* primary_hits = nullptr, PathRecord* record = nullptr) const {
+		pixel_colors.assign(primary_rays.size(), color(0, 0, 0));
+		std::vector<std::pair<int, PathVertex>> recorded_vertices; // (path, vertex) in the order they are traced
+
+		std::vector<PathState> paths;
+		paths.reserve(primary_rays.size() * samples);
+		bool recording = trace.guide && trace.guide->is_training();
+		std::vector<GuidePath> guide_paths;
+		if (recording) {
+			guide_paths.reserve(paths.capacity());
+		}
+
+		// primary hits are the same for every sample
+		for (size_t p = 0; p < primary_rays.size(); p++) {
+			const ray& render_ray = primary_rays[p];
+			RayHit primary_hit = primary_hits ? (*primary_hits)[p] : trace_hit(render_ray);
+			if (primary_hit.hit_time <= 0.0001) {
+				continue;
+			}
+
+			Mesh* primary_mesh = dynamic_cast<Mesh*>(primary_hit.hit_object);
+			point3 primary_hit_point = render_ray.at(primary_hit.hit_time);
+			vec3 primary_normal = primary_mesh->get_normal_vector(primary_hit.face_id, render_ray);
+
+			pixel_colors[p] += samples * primary_mesh->get_emission();
+			color primary_diffuse = primary_mesh->get_color(primary_hit.face_id, render_ray, get_footprint(trace, primary_hit.hit_time, 0));
+
+			for (int i = 0; i < samples; i++) {
+				BounceSample bounce = sample_bounce(trace, primary_mesh, render_ray, primary_normal, primary_hit_point);
+				int record_path = record ? int(p) * samples + i : -1;
+				if (record) {
+					recorded_vertices.emplace_back(record_path,
+						get_path_vertex(primary_mesh, primary_hit, render_ray, get_footprint(trace, primary_hit.hit_time, 0), bounce.weight));
+				}
+				if (bounce.weight <= 0) {
+					continue; // guided direction below the surface
+				}
+				PathState path;
+				path.current_ray = ray(primary_hit_point, bounce.direction);
+				path.throughput = primary_diffuse * bounce.weight;
+				path.path_length = primary_hit.hit_time;
+				path.pixel_index = int(p);
+				path.guide_path = -1;
+				path.origin_mesh = primary_mesh;
+				path.origin_lod = primary_hit.lod;
+				path.record_path = record_path;
+				if (recording) {
+					path.guide_path = int(guide_paths.size());
+					guide_paths.emplace_back();
+					if (max_bounces > 1 && bounce.pdf > 0) {
+						guide_paths.back().add_vertex(bounce.guide_leaf, bounce.diffuse_direction, bounce.pdf);
+					}
+				}
+				paths.push_back(path);
+			}
+		}
+
+		// trace one bounce of every path at a time
+		for (int j = 1; j < max_bounces && !paths.empty(); j++) {
+			for (PathState& path : paths) {
+				path.sort_key = get_sort_key(path.current_ray);
+			}
+			std::sort(paths.begin(), paths.end(),
+					  [](const PathState& a, const PathState& b) { return a.sort_key < b.sort_key; });
+
+			size_t alive = 0;
+			for (PathState& path : paths) {
+				RayHit hit = trace_hit(path.current_ray, get_lod_error(trace, path.path_length, j), path.origin_mesh, path.origin_lod);
+				if (hit.hit_time <= 0.0001) {
+					continue; // path leaves the scene
+				}
+
+				Mesh* hit_mesh = dynamic_cast<Mesh*>(hit.hit_object);
+				point3 hit_point = path.current_ray.at(hit.hit_time);
+				vec3 normal = hit_mesh->get_normal_vector(hit.face_id, path.current_ray, hit.lod);
+				path.path_length += hit.hit_time;
+				path.origin_mesh = hit_mesh;
+				path.origin_lod = hit.lod;
+
+				color emission = hit_mesh->get_emission();
+				color surface_color = hit_mesh->get_color(hit.face_id, path.current_ray, get_footprint(trace, path.path_length, j), hit.lod);
+				pixel_colors[path.pixel_index] += path.throughput * emission;
+
+				BounceSample bounce = sample_bounce(trace, hit_mesh, path.current_ray, normal, hit_point);
+				path.throughput = path.throughput * surface_color * bounce.weight;
+				if (path.record_path >= 0) {
+					recorded_vertices.emplace_back(path.record_path,
+						get_path_vertex(hit_mesh, hit, path.current_ray, get_footprint(trace, path.path_length, j), bounce.weight));
+				}
+				path.current_ray = ray(hit_point, bounce.direction);
+
+				if (path.guide_path >= 0) {
+					GuidePath& guide_path = guide_paths[path.guide_path];
+					guide_path.add_emission(emission);
+					guide_path.add_bounce_weight(surface_color * bounce.weight);
+					if (j + 1 < max_bounces && bounce.pdf > 0 && bounce.weight > 0) {
+						guide_path.add_vertex(bounce.guide_leaf, bounce.diffuse_direction, bounce.pdf);
+					}
+				}
+
+				if (bounce.weight > 0) {
+					paths[alive++] = path; // keep the path for the next bounce
+				}
+			}
+			paths.resize(alive);
+		}
+
+		for (const GuidePath& guide_path : guide_paths) {
+			guide_path.record(*trace.guide);
+		}
+
+		if (record) { // bring the vertices of every path together (the bounces stay in order)
+			std::stable_sort(recorded_vertices.begin(), recorded_vertices.end(),
+							 [](const auto& a, const auto& b) { return a.first < b.first; });
+			size_t next = 0;
+			for (int k = 0; k < int(primary_rays.size()) * samples; k++) {
+				record->begin_path();
+				for (; next < recorded_vertices.size() && recorded_vertices[next].first == k; next++) {
+					record->vertices.push_back(recorded_vertices[next].second);
+				}
+			}
+		}
+
+		for (color& pixel_color : pixel_colors) {
+			pixel_color /= samples;
+		}
+	}
+
+
 private:
     std::vector<std::shared_ptr<Mesh>> meshes;
+	BVH mesh_bvh; // top level hierarchy over the meshes
+	static constexpr int min_packet_rays = 4; // fewer packet rays than this reaching a mesh are traced one by one
+	point3 bounds_min = point3(infinity, infinity, infinity);
+	point3 bounds_max = point3(-infinity, -infinity, -infinity);
+	size_t geometry_version = 0;
+
+	// blend between the diffuse and the specular direction based on the roughness of the mesh
+	static vec3 get_bounce_direction(Mesh* mesh, const ray& incoming_ray, const vec3& normal) {
+		vec3 specular_direction = mesh->get_specular_direction(incoming_ray, normal);
+		vec3 diffuse_direction = mesh->get_diffuse_direction(normal);
+		return lerp(diffuse_direction, specular_direction, mesh->get_roughness());
+	}
+
+	// bounce direction like get_bounce_direction. with a trained guide the diffuse part is drawn from the
+	// learned directions for guide_fraction of the bounces (and from the cosine lobe otherwise), the weight
+	// is the cosine density over the density of that mixture, so the image stays the same on average
+	static BounceSample sample_bounce(const TraceSettings& trace, Mesh* mesh, const ray& incoming_ray, const vec3& normal,
+									  const point3& hit_point) {
+		BounceSample bounce;
+		const PathGuide* guide = trace.guide;
+		double guide_fraction = trace.guide_fraction;
+		if (!guide || mesh->get_roughness() >= 1) { // nothing to guide on mirrors
+			bounce.direction = get_bounce_direction(mesh, incoming_ray, normal);
+			return bounce;
+		}
+
+		bounce.guide_leaf = guide->get_leaf(hit_point);
+		const DirectionTree& tree = guide->get_sampling_tree(bounce.guide_leaf);
+		bool trained = tree.get_total() > 0;
+		if (trained && random_double() < guide_fraction) {
+			bounce.diffuse_direction = tree.sample();
+		}
+		else {
+			bounce.diffuse_direction = mesh->get_diffuse_direction(normal);
+		}
+
+		double cosine_pdf = std::max(0.0, dot(bounce.diffuse_direction, normal)) / pi;
+		bounce.pdf = trained ? guide_fraction * tree.pdf(bounce.diffuse_direction) + (1 - guide_fraction) * cosine_pdf : cosine_pdf;
+		bounce.weight = bounce.pdf > 0 ? cosine_pdf / bounce.pdf : 0;
+
+		vec3 specular_direction = mesh->get_specular_direction(incoming_ray, normal);
+		bounce.direction = lerp(bounce.diffuse_direction, specular_direction, mesh->get_roughness());
+		return bounce;
+	}
+
+	static PathVertex get_path_vertex(const Mesh* mesh, const RayHit& hit, const ray& hit_ray, double footprint, double weight) {
+		double u, v;
+		mesh->get_barycentric(hit.face_id, hit_ray, u, v, hit.lod);
+		return {mesh, hit.face_id, hit.lod, float(u), float(v), float(footprint), float(weight), mesh->get_roughness()};
+	}
+
+	// width of the ray after path_length, every bounce blurs the texture lookup by texture_bounce_bias mip levels
+	static double get_footprint(const TraceSettings& trace, double path_length, int depth) {
+		return trace.pixel_spread * path_length * std::ldexp(1.0, trace.texture_bounce_bias * depth);
+	}
+
+	// how coarse the meshes may be for the ray of bounce depth that starts after path_length (0 = full detail)
+	static double get_lod_error(const TraceSettings& trace, double path_length, int depth) {
+		return trace.use_lod && depth >= trace.lod_start_bounce ? get_footprint(trace, path_length, depth) : 0;
+	}
+
+	// direction octant in the top bits, morton code of the origin cell (64 cells per axis) below
+	uint32_t get_sort_key(const ray& render_ray) const {
+		uint32_t cell[3];
+		for (int i = 0; i < 3; i++) {
+			double extent = bounds_max[i] - bounds_min[i];
+			double relative = extent > 0 ? (render_ray.origin()[i] - bounds_min[i]) / extent : 0;
+			cell[i] = uint32_t(std::clamp(relative, 0.0, 1.0) * 63);
+		}
+		uint32_t octant = (render_ray.direction().x() < 0)
+						| ((render_ray.direction().y() < 0) << 1)
+						| ((render_ray.direction().z() < 0) << 2);
+		return (octant << 18) | morton_3d(cell[0], cell[1], cell[2]);
+	}
 };
 
+#endif
@@ -0,0 +1,18 @@
+#ifndef SIMPLIFY_H
+#define SIMPLIFY_H
+
+#include "mesh.h"
+
+#include <vector>
+
+// MESH SIMPLIFICATION //
+// quadric edge collapse (Garland and Heckbert), used to build the coarse detail levels of a mesh //
+
+
+// coarser and coarser versions of the mesh, every level has about 1/reduction of the faces of the one before
+// and the last one has at least min_faces. only vertices, faces and error are filled in. the texture
+// coordinates of merged corners are added to texture_coordinates (shared by all levels)
+std::vector<MeshLevel> build_detail_levels(const MeshLevel& mesh, std::vector<vec3>& texture_coordinates, int min_faces,
+                                           int reduction = 4);
+
+#endif
@@ -0,0 +1,93 @@
+#ifndef TEXTURE_H
+#define TEXTURE_H
+
+#include "color.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <ios>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// TEXTURES //
+// textures are never fully loaded, they are read in square tiles per mip level through the global texture cache //
+
+
+const int texture_tile_size = 64; // texels per tile side (has to be even)
+
+struct TextureTile {
+    int width, height;
+    std::vector<uint8_t> texels; // rgb, row by row
+
+    size_t memory_size() const { return sizeof(TextureTile) + texels.size(); }
+};
+
+
+class Texture {
+public:
+    Texture(const std::string& filename); // binary ppm (P6)
+
+    bool is_valid() const { return valid; }
+    int get_level_count() const { return level_count; }
+    uint32_t get_id() const { return texture_id; }
+
+    // texel density of level 0, used to pick the mip level from the ray footprint
+    int get_width() const { return width; }
+    int get_height() const { return height; }
+
+    // nearest texel of the given mip level (uv wraps around)
+    color sample(double u, double v, double level) const;
+
+    // builds one tile, level 0 is read from the file and higher levels are averaged from the level below
+    std::shared_ptr<const TextureTile> load_tile(int level, int tile_x, int tile_y) const;
+
+private:
+    std::string filename;
+    uint32_t texture_id;
+    bool valid = false;
+    int width = 0;
+    int height = 0;
+    int level_count = 0;
+    std::streamoff data_offset = 0; // start of the pixel data in the file
+
+    int get_level_width(int level) const { return std::max(1, width >> level); }
+    int get_level_height(int level) const { return std::max(1, height >> level); }
+};
+
+
+// tiles of all textures share one memory budget, the least recently used tiles are thrown out first.
+// the cache is split into shards with their own lock so render threads rarely wait for each other
+class TextureCache {
+public:
+    static TextureCache& global();
+
+    void set_budget(size_t bytes);
+    size_t get_memory_usage() const;
+
+    std::shared_ptr<const TextureTile> get(const Texture& texture, int level, int tile_x, int tile_y);
+
+private:
+    struct Entry {
+        std::shared_ptr<const TextureTile> tile;
+        std::list<uint64_t>::iterator lru_position;
+    };
+
+    struct Shard {
+        mutable std::mutex shard_mutex;
+        std::list<uint64_t> lru; // front is the most recently used tile
+        std::unordered_map<uint64_t, Entry> entries;
+        size_t memory_usage = 0;
+        size_t budget = (size_t(256) << 20) / shard_count; // 256 MB over all shards
+    };
+
+    static const int shard_count = 16;
+    Shard shards[shard_count];
+
+    void evict(Shard& shard);
+};
+
+#endif
@@ -0,0 +1,212 @@
+#include "bvh.h"
+
+#include <cmath>
+#include <future>
+#include <numeric>
+#include <thread>
+
+// BVH BUILDER //
+// binned surface area heuristic, big subtrees are built in parallel //
+
+
+namespace {
+    const int leaf_size = 4;
+    const int bin_count = 12;
+    const int max_depth = 60; // traversal stack has 64 entries
+}
+
+
+bool RayPacket::build_frustum(const point3& apex) {
+    has_frustum = false;
+    if (size == 0) {
+        return false;
+    }
+
+    // the axis the packet points along the most
+    vec3 direction_sum(0, 0, 0);
+    for (int r = 0; r < size; r++) {
+        direction_sum += rays[r].direction();
+    }
+    int main_axis = 0;
+    for (int i = 1; i < 3; i++) {
+        if (std::fabs(direction_sum[i]) > std::fabs(direction_sum[main_axis])) {
+            main_axis = i;
+        }
+    }
+    double sign = direction_sum[main_axis] < 0 ? -1 : 1;
+    int side_axes[2] = {(main_axis + 1) % 3, (main_axis + 2) % 3};
+
+    // smallest and largest slope of the rays on the two other axes, and the closest ray start
+    double slope_min[2] = {std::numeric_limits<double>::infinity(), std::numeric_limits<double>::infinity()};
+    double slope_max[2] = {-std::numeric_limits<double>::infinity(), -std::numeric_limits<double>::infinity()};
+    double nearest_start = std::numeric_limits<double>::infinity();
+    for (int r = 0; r < size; r++) {
+        const vec3& direction = rays[r].direction();
+        if (direction[main_axis] * sign < 1e-6) {
+            return false; // ray points sideways or backwards
+        }
+        for (int a = 0; a < 2; a++) {
+            double slope = direction[side_axes[a]] / direction[main_axis];
+            slope_min[a] = std::min(slope_min[a], slope);
+            slope_max[a] = std::max(slope_max[a], slope);
+        }
+        nearest_start = std::min(nearest_start, (rays[r].origin()[main_axis] - apex[main_axis]) * sign);
+    }
+
+    // a point p is inside if every plane has dot(normal, p) >= offset
+    auto set_plane = [&](int p, const vec3& normal, double distance) {
+        frustum_normals[p] = normal;
+        frustum_offsets[p] = dot(normal, apex) + distance;
+    };
+    vec3 main_unit(0, 0, 0);
+    main_unit[main_axis] = 1;
+    for (int a = 0; a < 2; a++) {
+        vec3 side_unit(0, 0, 0);
+        side_unit[side_axes[a]] = 1;
+        set_plane(2 * a, sign * (side_unit - slope_min[a] * main_unit), 0);
+        set_plane(2 * a + 1, sign * (slope_max[a] * main_unit - side_unit), 0);
+    }
+    set_plane(4, sign * main_unit, nearest_start); // nothing in front of the ray starts is hit
+
+    has_frustum = true;
+    return true;
+}
+
+
+void BVH::build(const std::vector<AABB>& primitive_bounds, int parallel_threshold) {
+    nodes.clear();
+    primitive_indices.resize(primitive_bounds.size());
+    std::iota(primitive_indices.begin(), primitive_indices.end(), 0);
+    if (primitive_bounds.empty()) {
+        return;
+    }
+
+    std::vector<point3> centroids;
+    centroids.reserve(primitive_bounds.size());
+    for (const AABB& box : primitive_bounds) {
+        centroids.push_back(box.centroid());
+    }
+
+    // only the top levels split off threads, so there are never many more threads than cores
+    int parallel_depth = 0;
+    while ((1u << parallel_depth) < std::thread::hardware_concurrency()) {
+        parallel_depth++;
+    }
+
+    nodes.reserve(2 * primitive_bounds.size() / leaf_size + 1);
+    build_subtree(nodes, primitive_bounds, centroids, 0, int(primitive_bounds.size()), 0, parallel_threshold, parallel_depth);
+}
+
+
+void BVH::build_subtree(std::vector<BVHNode>& out, const std::vector<AABB>& primitive_bounds,
+                        const std::vector<point3>& centroids, int begin, int end, int depth, int parallel_threshold,
+                        int parallel_depth) {
+    int node_index = int(out.size());
+    out.push_back(BVHNode());
+
+    AABB bounds;
+    AABB centroid_bounds;
+    for (int i = begin; i < end; i++) {
+        bounds.grow(primitive_bounds[primitive_indices[i]]);
+        centroid_bounds.grow(centroids[primitive_indices[i]]);
+    }
+    out[node_index].bounds = bounds;
+
+    int count = end - begin;
+    auto make_leaf = [&]() {
+        out[node_index].first_or_right = begin;
+        out[node_index].count = count;
+    };
+
+    // split along the longest axis of the centroids
+    vec3 extent = centroid_bounds.max - centroid_bounds.min;
+    int axis = 0;
+    if (extent[1] > extent[axis]) axis = 1;
+    if (extent[2] > extent[axis]) axis = 2;
+
+    if (count <= leaf_size || depth >= max_depth || extent[axis] <= 0) {
+        make_leaf();
+        return;
+    }
+
+    // sort the primitives into bins and find the cheapest split between two bins
+    AABB bin_bounds[bin_count];
+    int bin_counts[bin_count] = {0};
+    double bin_scale = bin_count / extent[axis];
+    auto get_bin = [&](int primitive) {
+        int bin = int((centroids[primitive][axis] - centroid_bounds.min[axis]) * bin_scale);
+        return std::min(bin, bin_count - 1);
+    };
+    for (int i = begin; i < end; i++) {
+        int bin = get_bin(primitive_indices[i]);
+        bin_bounds[bin].grow(primitive_bounds[primitive_indices[i]]);
+        bin_counts[bin]++;
+    }
+
+    double right_cost[bin_count];
+    AABB right_box;
+    int right_count = 0;
+    for (int b = bin_count - 1; b > 0; b--) {
+        right_box.grow(bin_bounds[b]);
+        right_count += bin_counts[b];
+        right_cost[b] = right_count * right_box.surface_area();
+    }
+
+    double best_cost = std::numeric_limits<double>::infinity();
+    int best_split = -1;
+    AABB left_box;
+    int left_count = 0;
+    for (int b = 0; b < bin_count - 1; b++) {
+        left_box.grow(bin_bounds[b]);
+        left_count += bin_counts[b];
+        if (left_count == 0 || left_count == count) {
+            continue;
+        }
+        double cost = left_count * left_box.surface_area() + right_cost[b + 1];
+        if (cost < best_cost) {
+            best_cost = cost;
+            best_split = b;
+        }
+    }
+
+    // splitting has to be cheaper than testing every primitive of the node
+    if (best_split < 0 || (count <= 16 && best_cost >= count * bounds.surface_area())) {
+        make_leaf();
+        return;
+    }
+
+    int* middle = std::partition(primitive_indices.data() + begin, primitive_indices.data() + end,
+                                 [&](int primitive) { return get_bin(primitive) <= best_split; });
+    int mid = int(middle - primitive_indices.data());
+
+    out[node_index].count = 0;
+    if (count >= parallel_threshold && depth < parallel_depth) {
+        // left half on another thread, the halves touch disjoint ranges of primitive_indices
+        std::vector<BVHNode> left_nodes;
+        auto left_build = std::async(std::launch::async, [&]() {
+            build_subtree(left_nodes, primitive_bounds, centroids, begin, mid, depth + 1, parallel_threshold, parallel_depth);
+        });
+        std::vector<BVHNode> right_nodes;
+        build_subtree(right_nodes, primitive_bounds, centroids, mid, end, depth + 1, parallel_threshold, parallel_depth);
+        left_build.get();
+
+        // append both subtrees and move their child indices to the new position
+        auto append = [&](const std::vector<BVHNode>& subtree) {
+            int offset = int(out.size());
+            for (BVHNode node : subtree) {
+                if (node.count == 0) {
+                    node.first_or_right += offset;
+                }
+                out.push_back(node);
+            }
+        };
+        append(left_nodes);
+        out[node_index].first_or_right = int(out.size());
+        append(right_nodes);
+    }
+    else {
+        build_subtree(out, primitive_bounds, centroids, begin, mid, depth + 1, parallel_threshold, parallel_depth);
+        out[node_index].first_or_right = int(out.size());
+        build_subtree(out, primitive_bounds, centroids, mid, end, depth + 1, parallel_threshold, parallel_depth);
+    }
+}
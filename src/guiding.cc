@@ -0,0 +1,320 @@
+#include "leo-raytracer.h"
+
+#include <algorithm>
+#include <cmath>
+
+// PATH GUIDING //
+// Leo Martin (2025) //
+
+
+namespace {
+    void atomic_add(std::atomic<float>& target, float value) {
+        float current = target.load(std::memory_order_relaxed);
+        while (!target.compare_exchange_weak(current, current + value, std::memory_order_relaxed)) {
+        }
+    }
+
+    // (cos theta, phi) of a direction, both scaled to [0, 1]
+    void direction_to_square(const vec3& direction, double& x, double& y) {
+        vec3 unit = normalize(direction);
+        x = std::clamp((unit.z() + 1) / 2, 0.0, 1.0);
+        double phi = std::atan2(unit.y(), unit.x());
+        if (phi < 0) {
+            phi += 2 * pi;
+        }
+        y = std::clamp(phi / (2 * pi), 0.0, 1.0);
+    }
+
+    vec3 square_to_direction(double x, double y) {
+        double cos_theta = 2 * x - 1;
+        double sin_theta = std::sqrt(std::max(0.0, 1 - cos_theta * cos_theta));
+        double phi = 2 * pi * y;
+        return vec3(sin_theta * std::cos(phi), sin_theta * std::sin(phi), cos_theta);
+    }
+
+    // quadrant of a point in the unit square: bit 0 is the right half, bit 1 the upper half.
+    // the point is moved into the unit square of the quadrant
+    int get_quadrant(double& x, double& y) {
+        int quadrant = 0;
+        if (x >= 0.5) {
+            quadrant |= 1;
+            x -= 0.5;
+        }
+        if (y >= 0.5) {
+            quadrant |= 2;
+            y -= 0.5;
+        }
+        x *= 2;
+        y *= 2;
+        return quadrant;
+    }
+}
+
+
+DirectionTree::Node::Node() {
+    for (std::atomic<float>& value : values) {
+        value = 0;
+    }
+}
+
+DirectionTree::Node::Node(const Node& other) {
+    *this = other;
+}
+
+DirectionTree::Node& DirectionTree::Node::operator=(const Node& other) {
+    for (int q = 0; q < 4; q++) {
+        values[q] = other.values[q].load();
+        children[q] = other.children[q];
+    }
+    return *this;
+}
+
+DirectionTree::DirectionTree(const DirectionTree& other) : nodes(other.nodes), sample_count(other.sample_count.load()) {}
+
+DirectionTree& DirectionTree::operator=(const DirectionTree& other) {
+    nodes = other.nodes;
+    sample_count = other.sample_count.load();
+    return *this;
+}
+
+
+void DirectionTree::record(const vec3& direction, float value) {
+    sample_count++;
+    if (!(value > 0) || !std::isfinite(value)) {
+        return; // counts as a sample but adds no energy
+    }
+    double x, y;
+    direction_to_square(direction, x, y);
+    int node = 0;
+    while (true) {
+        int quadrant = get_quadrant(x, y);
+        atomic_add(nodes[node].values[quadrant], value);
+        if (nodes[node].children[quadrant] == 0) {
+            return;
+        }
+        node = nodes[node].children[quadrant];
+    }
+}
+
+
+vec3 DirectionTree::sample() const {
+    double x = 0, y = 0;
+    double size = 1;
+    int node = 0;
+    while (true) {
+        const Node& current = nodes[node];
+        float total = 0;
+        for (int q = 0; q < 4; q++) {
+            total += current.values[q].load(std::memory_order_relaxed);
+        }
+
+        // pick a quadrant proportional to its value
+        double pick = random_double() * total;
+        int quadrant = 0;
+        while (quadrant < 3 && pick >= current.values[quadrant].load(std::memory_order_relaxed)) {
+            pick -= current.values[quadrant].load(std::memory_order_relaxed);
+            quadrant++;
+        }
+
+        size /= 2;
+        x += (quadrant & 1) * size;
+        y += (quadrant >> 1) * size;
+        if (current.children[quadrant] == 0) {
+            break;
+        }
+        node = current.children[quadrant];
+    }
+    // uniform inside the leaf cell
+    return square_to_direction(x + random_double() * size, y + random_double() * size);
+}
+
+
+double DirectionTree::pdf(const vec3& direction) const {
+    double x, y;
+    direction_to_square(direction, x, y);
+    double square_pdf = 1;
+    int node = 0;
+    while (true) {
+        const Node& current = nodes[node];
+        float total = 0;
+        for (int q = 0; q < 4; q++) {
+            total += current.values[q].load(std::memory_order_relaxed);
+        }
+        if (total <= 0) {
+            return 0;
+        }
+        int quadrant = get_quadrant(x, y);
+        square_pdf *= 4 * current.values[quadrant].load(std::memory_order_relaxed) / total;
+        if (current.children[quadrant] == 0) {
+            break;
+        }
+        node = current.children[quadrant];
+    }
+    return square_pdf / (4 * pi); // the square covers the sphere (4 pi) without distortion
+}
+
+
+float DirectionTree::get_total() const {
+    float total = 0;
+    for (const std::atomic<float>& value : nodes[0].values) {
+        total += value.load(std::memory_order_relaxed);
+    }
+    return total;
+}
+
+
+DirectionTree DirectionTree::refined(float subdivide_fraction, int max_depth) const {
+    DirectionTree result;
+    float total = get_total();
+    if (total <= 0) {
+        return result; // nothing learned, the result is not sampled
+    }
+
+    // cells of this tree, or cells below its leaves that get an even share of their leaf (source is -1 then)
+    struct Task {
+        int source;
+        float values[4];
+        int target;
+        int depth;
+    };
+    std::vector<Task> tasks;
+    tasks.push_back({0, {0, 0, 0, 0}, 0, 1});
+    while (!tasks.empty()) {
+        Task task = tasks.back();
+        tasks.pop_back();
+        for (int q = 0; q < 4; q++) {
+            float value = task.source >= 0 ? nodes[task.source].values[q].load() : task.values[q];
+            result.nodes[task.target].values[q] = value;
+            // new cells only hold an even share of their leaf, splitting them again would not change the
+            // density, so the tree grows by at most one level per iteration
+            if (task.source < 0 || value / total <= subdivide_fraction || task.depth >= max_depth) {
+                continue;
+            }
+
+            int child = int(result.nodes.size());
+            result.nodes.emplace_back();
+            result.nodes[task.target].children[q] = child;
+
+            Task next = {-1, {value / 4, value / 4, value / 4, value / 4}, child, task.depth + 1};
+            if (task.source >= 0 && nodes[task.source].children[q] != 0) {
+                next.source = nodes[task.source].children[q];
+            }
+            tasks.push_back(next);
+        }
+    }
+    return result;
+}
+
+
+void DirectionTree::clear_values() {
+    for (Node& node : nodes) {
+        for (std::atomic<float>& value : node.values) {
+            value = 0;
+        }
+    }
+    sample_count = 0;
+}
+
+
+PathGuide::PathGuide(const AABB& scene_bounds) : bounds(scene_bounds) {
+    // a little larger, so points on the bounds are inside
+    vec3 margin = (bounds.max - bounds.min) * 0.001 + vec3(1e-6, 1e-6, 1e-6);
+    bounds.min = bounds.min - margin;
+    bounds.max = bounds.max + margin;
+
+    nodes.push_back({0, 0, 0});
+    leaves.emplace_back();
+}
+
+
+int PathGuide::get_leaf(const point3& position) const {
+    point3 box_min = bounds.min;
+    point3 box_max = bounds.max;
+    int node = 0;
+    while (nodes[node].children != 0) {
+        int axis = nodes[node].depth % 3;
+        double middle = (box_min[axis] + box_max[axis]) / 2;
+        if (position[axis] < middle) {
+            box_max[axis] = middle;
+            node = nodes[node].children;
+        }
+        else {
+            box_min[axis] = middle;
+            node = nodes[node].children + 1;
+        }
+    }
+    return nodes[node].leaf;
+}
+
+
+void PathGuide::refine() {
+    iteration++;
+
+    // split the leaves that got many samples, both halves start with the directions of the parent.
+    // new nodes are appended, so they are checked again further down in the same loop
+    for (size_t n = 0; n < nodes.size(); n++) {
+        if (nodes[n].children != 0 || nodes[n].depth >= max_spatial_depth) {
+            continue;
+        }
+        uint32_t samples = leaves[nodes[n].leaf].recording.get_sample_count();
+        if (samples <= spatial_threshold) {
+            continue;
+        }
+
+        leaves[nodes[n].leaf].recording.set_sample_count(samples / 2);
+        int left_leaf = nodes[n].leaf;
+        int right_leaf = int(leaves.size());
+        Leaf right = leaves[left_leaf];
+        leaves.push_back(right);
+
+        int depth = nodes[n].depth + 1;
+        nodes[n].children = int(nodes.size());
+        nodes.push_back({depth, 0, left_leaf});
+        nodes.push_back({depth, 0, right_leaf});
+    }
+
+    // what was recorded is sampled in the next iteration, recording starts over with the same cells
+    for (Leaf& leaf : leaves) {
+        leaf.sampling = leaf.recording.refined(direction_threshold, max_direction_depth);
+        leaf.recording = leaf.sampling;
+        leaf.recording.clear_values();
+    }
+}
+
+
+size_t PathGuide::memory_size() const {
+    size_t size = nodes.size() * sizeof(SpatialNode);
+    for (const Leaf& leaf : leaves) {
+        size += leaf.sampling.memory_size() + leaf.recording.memory_size();
+    }
+    return size;
+}
+
+
+void GuidePath::add_vertex(int leaf, const vec3& direction, double pdf) {
+    if (vertex_count == max_vertices) {
+        return;
+    }
+    vertices[vertex_count++] = {leaf, direction, pdf, color(1, 1, 1), color(0, 0, 0)};
+}
+
+void GuidePath::add_emission(const color& emission) {
+    for (int v = 0; v < vertex_count; v++) {
+        vertices[v].radiance += vertices[v].weight * emission;
+    }
+}
+
+void GuidePath::add_bounce_weight(const color& weight) {
+    for (int v = 0; v < vertex_count; v++) {
+        vertices[v].weight = vertices[v].weight * weight;
+    }
+}
+
+void GuidePath::record(PathGuide& guide) const {
+    // radiance / pdf estimates the light of the whole cell the direction falls into
+    for (int v = 0; v < vertex_count; v++) {
+        const Vertex& vertex = vertices[v];
+        double brightness = (vertex.radiance.x() + vertex.radiance.y() + vertex.radiance.z()) / 3;
+        guide.record(vertex.leaf, vertex.direction, float(brightness / vertex.pdf));
+    }
+}
@@ -1,81 +1,201 @@
 #include "leo-raytracer.h"
+#include "renderer.h"
 
-#include <memory>
 #include <fstream>
-#include <sstream>
 #include <string>
 #include <algorithm>
 #include <vector>
 #include <iostream>
 #include <chrono>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <cstdio>
 
 // RAY-TRACER //
 // Leo Martin (2025) //
 
 
-// render image
-int main() {
-	const int image_width = 480;
-	const int image_height = 480;
-	
-	const float start_x = -2;
-	const float start_y = 2;
+void write_image(std::ostream& out, const Framebuffer& framebuffer) {
+	out << "P3\n" << framebuffer.width << ' ' << framebuffer.height << "\n255\n"; // PPM header
+	for (int p = 0; p < framebuffer.width * framebuffer.height; p++) {
+		write_color(out, framebuffer.pixels[p]);
+	}
+}
 
-	const int samples = 3;
-	const int max_bounces = 3;
+// "-" appends the image to stdout (a stream of PPM frames for a pipe), otherwise the file is replaced
+// in one step so a viewer never sees a half written image
+void write_preview(const std::string& path, const Framebuffer& framebuffer) {
+	if (path == "-") {
+		write_image(std::cout, framebuffer);
+		std::cout << std::flush;
+		return;
+	}
+	std::string temporary_path = path + ".tmp";
+	{
+		std::ofstream file(temporary_path);
+		write_image(file, framebuffer);
+	}
+	std::rename(temporary_path.c_str(), path.c_str());
+}
 
-    const float pixel_size = -2 * start_x / image_width;
 
-	const float center_pixel = pixel_size / 2;
-	const int height = image_height / pixel_size;
-    const int width = image_width / pixel_size;
+// render image
+int main() {
+	RenderSettings settings;
+	settings.image_width = 480;
+	settings.image_height = 480;
+
+	// camera rays per pixel (spread over the pixel, antialiasing) and paths per camera ray (less noise for the
+	// same primary hit), a pixel gets primary_samples * samples paths
+	settings.primary_samples = 3;
+	settings.samples = 1;
+	settings.max_bounces = 3;
+
+	// pixel reconstruction: how the camera rays near a pixel are weighted
+	settings.pixel_filter = PixelFilter::box; // box, tent or blackman_harris
+	settings.filter_radius = 0;               // pixels, 0 = the usual radius of the filter
+
+	// work scheduling
+	settings.tile_size = 16;
+	settings.tile_order = TileOrder::hilbert;
+	settings.sort_secondary_rays = true; // trace bounce rays in sorted batches per tile
+	settings.threads = std::max(1u, std::thread::hardware_concurrency());
+
+	// progressive preview: coarse passes first (resolution doubles each pass), then the samples
+	// per pixel double each pass until target_samples is reached or the time budget is used up
+	settings.progressive = false;
+	settings.coarse_scale = 8;           // first pass renders one pixel per 8x8 block (power of two, at most tile_size)
+	settings.target_samples = 64;        // paths per camera ray of all passes together
+	settings.time_budget = settings.progressive ? 1.0 : 0; // seconds, 0 = no limit
+	const std::string preview_output = "preview.ppm"; // every pass is written here, "-" writes to stdout
+
+	// path guiding: learns where the light comes from during the first passes and sends later diffuse bounces there
+	// (without progressive the passes split the samples per camera ray, or the camera rays per pixel if samples
+	// is 1, so it needs more than one of them)
+	settings.path_guiding = false;
+	settings.guide_training_passes = 4;
+
+	// levels of detail: deeper bounce rays hit simplified meshes (built when the meshes load, only if this
+	// is on) once they are wider than the simplification error, which saves triangle tests on the blurry
+	// indirect light
+	settings.mesh_lod = false;
+	settings.lod_start_bounce = 1;
+
+	// lookdev: the paths of the render are kept and the image is shaded again whenever an mtl file changes
+	// (written to preview_output), only changes to Ns need tracing again. runs until the program is stopped
+	const bool lookdev = false;
+	settings.record_paths = lookdev;
+	settings.path_cache_budget = size_t(2) << 30; // bytes, no lookdev if the paths need more
+
+	// textures
+	const size_t texture_cache_size = size_t(256) << 20; // memory budget of all texture tiles (bytes)
+
+	// out of core geometry: meshes join the scene with their bounds only and load when a ray hits them
+	const bool lazy_meshes = false;
+	const size_t geometry_cache_size = size_t(1) << 30; // memory budget of all loaded lazy meshes (bytes)
+
+	TextureCache::global().set_budget(texture_cache_size);
+	GeometryCache::global().set_budget(geometry_cache_size);
 
 	// initiate scene (populate with meshes)
+	auto load_start = std::chrono::steady_clock::now();
 	MeshScene scene;
 
-    scene.add(make_shared<Mesh>("objects/top-wall.obj"));
-    scene.add(make_shared<Mesh>("objects/bottom-wall.obj"));
-    scene.add(make_shared<Mesh>("objects/left-wall.obj"));
-    scene.add(make_shared<Mesh>("objects/right-wall.obj"));
-    scene.add(make_shared<Mesh>("objects/back-wall.obj"));
-    scene.add(make_shared<Mesh>("objects/reflector.obj"));
-    scene.add(make_shared<Mesh>("objects/monke.obj"));
- 	
-	auto render_start = std::chrono::high_resolution_clock::now();
-	// render
-	std::cout << "P3\n" << image_width << ' ' << image_height << "\n255\n"; // PPM header 
-    color pixel_color;
-    float x_pos, y_pos;
-    //auto row_start = chrono::high_resolution_clock::now();
-
-
-	for (int j = 0; j < image_height; j++) { // row
-		//auto row_start = chrono::high_resolution_clock::now();
-		std::clog << "\rScanlines remaining: " << (image_height - j) << ' ' << std::flush; // progress meter
-		//auto row_start = chrono::high_resolution_clock::now();
-
-		y_pos = start_y - (pixel_size * j) - center_pixel;
-		for (int i = 0; i < image_width; i++) { // column
-		    x_pos = start_x + (pixel_size * i) + center_pixel;
-			point3 camera_start(0,0,5);
-			vec3 cell_center(x_pos,y_pos,2); // cell start has to not clip through the object
-			vec3 ray_direction = cell_center - camera_start;
-		    ray_direction = normalize(ray_direction);
-            ray render_ray(cell_center, ray_direction);
-			
-
-			color path_color = scene.trace_path(render_ray, samples, max_bounces);
-		    write_color(std::cout, path_color);
-
-		    //chrono::duration<double> elapsed_time = render_end - render_start;
-
-		}
-    }
-	auto render_end = std::chrono::high_resolution_clock::now();
+	scene.load({
+		"objects/top-wall.obj",
+		"objects/bottom-wall.obj",
+		"objects/left-wall.obj",
+		"objects/right-wall.obj",
+		"objects/back-wall.obj",
+		"objects/reflector.obj",
+		"objects/monke.obj",
+	}, settings.threads, lazy_meshes, settings.mesh_lod);
+
+	std::chrono::duration<double> load_time = std::chrono::steady_clock::now() - load_start;
+	std::clog << "Scene loaded in: " << load_time.count() << "sec\n";
+
+	// camera at z = 5 looking down -z, rays start on the image plane at z = 2 (cell start has to not clip through the object)
+	Renderer renderer(scene);
+	renderer.settings = settings;
+	renderer.camera.look(point3(0, 0, 5), point3(0, 0, 0));
+	renderer.camera.image_plane_distance = 3;
+	renderer.camera.image_plane_width = 4;
+	renderer.camera.pixel_sampling = PixelSampling::stratified; // center, jittered or stratified
+
+	// the renderer writes straight into this memory
+	std::vector<color> pixels(settings.image_width * settings.image_height);
+	Framebuffer framebuffer{pixels.data(), settings.image_width, settings.image_height};
+
+	size_t tile_count = make_tiles(settings.image_width, settings.image_height, settings.tile_size, settings.tile_order).size();
+	std::atomic<size_t> tiles_done(0);
+	std::mutex progress_mutex;
+	auto render_start = std::chrono::steady_clock::now();
+
+	RenderCallbacks callbacks;
+	if (!settings.progressive) {
+		callbacks.tile_done = [&](const Tile&, int) {
+			std::lock_guard<std::mutex> lock(progress_mutex);
+			std::clog << "\rTiles remaining: " << (tile_count - ++tiles_done) << ' ' << std::flush; // progress meter
+		};
+		callbacks.pass_done = [&](int, int) {
+			tiles_done = 0; // path guiding splits the samples into several passes
+		};
+	}
+	else {
+		callbacks.pass_done = [&](int pass, int total_samples) {
+			write_preview(preview_output, framebuffer);
+
+			std::chrono::duration<double> pass_time = std::chrono::steady_clock::now() - render_start;
+			std::clog << "Pass " << pass << ": " << total_samples << " samples, " << pass_time.count() << "sec\n";
+		};
+	}
+
+	bool completed = renderer.render(framebuffer, callbacks);
+
+	// write image
+	if (!settings.progressive) {
+		write_image(std::cout, framebuffer);
+	}
+	else {
+		write_preview(preview_output, framebuffer); // best image within the time budget
+	}
+
+	auto render_end = std::chrono::steady_clock::now();
 	std::chrono::duration<double> elapsed_time = render_end - render_start;
-	std::clog << "\rRender Done in: " << elapsed_time.count() << "sec\n";
+	std::clog << "\rRender Done in: " << elapsed_time.count() << "sec" << (completed ? "\n" : " (stopped at the time budget)\n");
+
+	if (lookdev) {
+		std::clog << "Path cache: " << (renderer.get_path_cache_size() >> 20) << "MB"
+				  << (renderer.has_recorded_paths() ? ", watching the obj and mtl files\n" : " (over the budget, no lookdev)\n");
+	}
+	while (lookdev && renderer.has_recorded_paths()) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+		// new geometry makes the recorded hits useless, the whole image is traced again (and recorded)
+		if (scene.geometry_changed()) {
+			auto trace_start = std::chrono::steady_clock::now();
+			scene.reload_geometry();
+			scene.reload_materials();
+			renderer.render(framebuffer);
+			write_preview(preview_output, framebuffer);
+
+			std::chrono::duration<double> trace_time = std::chrono::steady_clock::now() - trace_start;
+			std::clog << "Geometry changed, image traced again in: " << trace_time.count() << "sec\n";
+			continue;
+		}
+		if (!scene.reload_materials()) {
+			continue;
+		}
+		auto shade_start = std::chrono::steady_clock::now();
+		renderer.render_materials(framebuffer);
+		write_preview(preview_output, framebuffer);
+
+		std::chrono::duration<double> shade_time = std::chrono::steady_clock::now() - shade_start;
+		std::clog << "Materials changed, image updated in: " << shade_time.count() << "sec\n";
+	}
 }
-				
+
 
 
 
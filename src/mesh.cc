@@ -1,4 +1,5 @@
 #include "leo-raytracer.h"
+#include "simplify.h"
 
 #include <fstream>
 #include <sstream>
@@ -7,31 +8,80 @@
 #include <limits>
 #include <cmath>
 #include <filesystem>
+#include <cstdlib>
+#include <random>
+#include <thread>
 
 // OBJ MESH LOADER //
 // Leo Martin (2025) //
 
 
-Mesh::Mesh(const std::string& filename) {
-    if (!load_obj(filename)) {
+Mesh::Mesh(const std::string& filename, MaterialLibrary* materials, bool lazy, bool detail_levels)
+	: filename(filename), lazy(lazy), detail_levels(detail_levels) {
+	std::error_code error;
+	loaded_time = std::filesystem::last_write_time(filename, error); // before reading, so an edit while loading counts as a change
+	std::string header_file = filename + ".bounds";
+
+	if (lazy && read_header(header_file)) {
+		// bounds and material are known, the geometry waits for the first ray
+	}
+	else if (lazy) { // first run: only scan the obj for its bounds and write the header for next time
+		if (!load_obj(filename, nullptr)) {
 			std::cerr << "Failed to load mesh from: " << filename << "\n";
-    }
-    calculate_vertex_normals();
-	get_bounding_box();
-	
+		}
+	}
+	else {
+		auto loaded_geometry = std::make_shared<MeshGeometry>();
+		if (!load_obj(filename, loaded_geometry.get())) {
+			std::cerr << "Failed to load mesh from: " << filename << "\n";
+		}
+		calculate_vertex_normals(*loaded_geometry);
+		get_bounding_box(*loaded_geometry);
+		build_bvh(*loaded_geometry);
+		if (detail_levels) {
+			build_lods(*loaded_geometry);
+		}
+		geometry = loaded_geometry;
+	}
+
+    // create material object and make pointer that links to it
+    std::filesystem::path mtl_file_path = std::filesystem::path(filename).parent_path() / mtl_file;
+	if (materials) {
+		material_pointer = materials->get(mtl_file_path.string(), material_name); // resolved once per scene
+	} else {
+		material_pointer = std::make_shared<Material>(mtl_file_path.string(), material_name);
+	}
+}
+
+Mesh::Mesh(std::vector<point3> vertices, std::vector<Face> faces, std::shared_ptr<Material> material,
+		   bool smooth_shading, std::vector<vec3> texture_coordinates, bool detail_levels)
+	: smooth_shading(smooth_shading), lazy(false), detail_levels(detail_levels), material_pointer(material) {
+	auto loaded_geometry = std::make_shared<MeshGeometry>();
+	loaded_geometry->vertices = std::move(vertices);
+	loaded_geometry->faces = std::move(faces);
+	loaded_geometry->texture_coordinates = std::move(texture_coordinates);
+	calculate_vertex_normals(*loaded_geometry);
+	get_bounding_box(*loaded_geometry);
+	build_bvh(*loaded_geometry);
+	if (detail_levels) {
+		build_lods(*loaded_geometry);
+	}
+	geometry = loaded_geometry;
 }
 
-bool Mesh::load_obj(const std::string& filename) {
-	std::filesystem::path obj_path(filename);
-	std::filesystem::path directory = obj_path.parent_path();
+Mesh::~Mesh() {
+	if (lazy) {
+		GeometryCache::global().forget(this);
+	}
+}
 
+bool Mesh::parse_obj(const std::string& filename, MeshGeometry* geometry, ObjHeader& header) {
 	std::ifstream obj(filename);
     if (!obj.is_open()) {
         return false;
     }
 
-	std::string material_name;
-	std::string mtl_file;
+	size_t skipped_faces = 0;
 
 	std::string line;
     while (getline(obj, line)) {
@@ -43,50 +93,419 @@ bool Mesh::load_obj(const std::string& filename) {
         stream >> prefix;
 
         if (prefix == "o") { // object name
-            stream >> object_name;
+            stream >> header.object_name;
         }
         else if (prefix == "s") { // smooth shading flag
-            stream >> smooth_shading;
+            stream >> header.smooth_shading;
         }
 		else if (prefix == "mtllib") { // material file
-            stream >> mtl_file;	
+            stream >> header.mtl_file;	
         }
         else if (prefix == "usemtl") { // material name
-			stream >> material_name;
+			stream >> header.material_name;
         }
 		else if (prefix == "v") { // vertex
             float x, y, z;
             stream >> x >> y >> z;
-            vertices.push_back(point3(x, y, z));
+			if (geometry) {
+				geometry->vertices.push_back(point3(x, y, z));
+			} else {
+				header.bounds.grow(point3(x, y, z));
+			}
+        }
+		else if (prefix == "vt" && geometry) { // texture coordinate
+            float u, v;
+            stream >> u >> v;
+            geometry->texture_coordinates.push_back(vec3(u, v, 0));
         }
+        else if (prefix == "f" && !geometry) {
+			header.face_count++;
+		}
         else if (prefix == "f") { // face
             Face current_face;
 			std::string token;
             int i = 0;
-            while (stream >> token && i < 3) { // have to make a system that works with quads and triangulates the face
-                // break down face and only take the index (index/vertex_texture/vertex_normal)
-				std::replace(token.begin(), token.end(), '/', ' ');
-				std::istringstream point_stream(token);
-                int vertex_index;
-                point_stream >> vertex_index;
-                current_face.face_vertices[i] = vertex_index - 1; // .obj indices start at 1
+            while (i < 3 && stream >> token) { // have to make a system that works with quads and triangulates the face
+                // break down face into index/vertex_texture/vertex_normal (texture and normal are optional)
+				const char* text = token.c_str();
+				char* end;
+				long index = std::strtol(text, &end, 10); // .obj indices start at 1
+				if (end == text || index < 1 || index > long(geometry->vertices.size()) || (*end != '\0' && *end != '/')) {
+					break;
+				}
+                current_face.face_vertices[i] = int(index - 1);
+				if (*end == '/' && end[1] != '/' && end[1] != '\0') {
+					text = end + 1;
+					index = std::strtol(text, &end, 10);
+					if (end == text || index < 1 || (*end != '\0' && *end != '/')) {
+						break;
+					}
+					current_face.face_uvs[i] = int(index - 1);
+				}
                 i++;
-            } 
-            faces.push_back(current_face);
+            }
+			if (i < 3) {
+				skipped_faces++; // malformed line, the rest of the mesh is still usable
+				continue;
+			}
+            geometry->faces.push_back(current_face);
         }
     }
     obj.close();
+	if (skipped_faces > 0) {
+		std::cerr << "Skipped " << skipped_faces << " malformed faces in: " << filename << "\n";
+	}
+
+    return true;
+}
 
-    // create material object and make pointer that links to it	
-    std::filesystem::path mtl_file_path = directory / mtl_file;
-    material_pointer = std::make_shared<Material>(mtl_file_path.string(), material_name);
+bool Mesh::load_obj(const std::string& filename, MeshGeometry* geometry) {
+	ObjHeader header;
+	if (!parse_obj(filename, geometry, header)) {
+		return false;
+	}
+	object_name = header.object_name;
+	smooth_shading = header.smooth_shading;
+	mtl_file = header.mtl_file;
+	material_name = header.material_name;
+
+	if (!geometry) {
+		bounding_box_min = header.bounds.min;
+		bounding_box_max = header.bounds.max;
+		write_header(filename + ".bounds", header.face_count);
+	}
     return true;
 }
 
-void Mesh::calculate_vertex_normals() { // average from adjacent faces
+
+// HEADER FILE //
+// small text file next to the obj so lazy meshes can join the scene without reading the obj //
+
+namespace {
+	// false if the file is missing, older than the obj or its time can not be read
+	bool is_up_to_date(const std::string& file, const std::string& obj_file) {
+		std::error_code error;
+		if (!std::filesystem::exists(file, error)) {
+			return false;
+		}
+		auto file_time = std::filesystem::last_write_time(file, error);
+		if (error) {
+			return false;
+		}
+		auto obj_time = std::filesystem::last_write_time(obj_file, error);
+		return !error && file_time >= obj_time;
+	}
+
+	// files are written under a name of their own first (several threads or renders may write the same
+	// file at once) and then moved over the old one, so readers never see half a file
+	std::string temporary_name(const std::string& file) {
+		static std::atomic<uint64_t> counter{0};
+		std::ostringstream name;
+		name << file << '.' << std::hex << std::random_device()() << '.' << std::this_thread::get_id() << '.' << counter++ << ".tmp";
+		return name.str();
+	}
+
+	bool replace_file(const std::string& temporary_file, const std::string& file) {
+		std::error_code error;
+		std::filesystem::rename(temporary_file, file, error);
+		if (error) {
+			std::filesystem::remove(temporary_file, error); // the file is simply written again next time
+			return false;
+		}
+		return true;
+	}
+}
+
+bool Mesh::read_header(const std::string& header_file) {
+	if (!is_up_to_date(header_file, filename)) {
+		return false; // the header is outdated as soon as the obj changes
+	}
+
+	std::ifstream header(header_file);
+	bool has_bounds = false;
+	std::string line;
+	while (std::getline(header, line)) {
+		std::istringstream stream(line);
+		std::string prefix;
+		stream >> prefix;
+
+		if (prefix == "bounds") {
+			stream >> bounding_box_min[0] >> bounding_box_min[1] >> bounding_box_min[2]
+				   >> bounding_box_max[0] >> bounding_box_max[1] >> bounding_box_max[2];
+			has_bounds = !stream.fail();
+		}
+		else if (prefix == "o") {
+			stream >> object_name;
+		}
+		else if (prefix == "s") {
+			stream >> smooth_shading;
+		}
+		else if (prefix == "mtllib") {
+			stream >> mtl_file;
+		}
+		else if (prefix == "usemtl") {
+			stream >> material_name;
+		}
+	}
+	return has_bounds;
+}
+
+void Mesh::write_header(const std::string& header_file, size_t face_count) const {
+	std::string temporary_file = temporary_name(header_file);
+	{
+		std::ofstream header(temporary_file);
+		if (!header.is_open()) {
+			return; // read only asset directory, the obj is scanned again next time
+		}
+		header.precision(17);
+		header << "# leo-raytracer mesh header (regenerated when the obj changes)\n";
+		header << "bounds " << bounding_box_min << ' ' << bounding_box_max << "\n";
+		header << "faces " << face_count << "\n";
+		header << "o " << object_name << "\n";
+		header << "s " << smooth_shading << "\n";
+		header << "mtllib " << mtl_file << "\n";
+		header << "usemtl " << material_name << "\n";
+	}
+	replace_file(temporary_file, header_file);
+}
+
+
+// LAZY GEOMETRY //
+
+size_t MeshLevel::memory_size() const {
+	return sizeof(MeshLevel)
+		 + vertices.capacity() * sizeof(point3)
+		 + faces.capacity() * sizeof(Face)
+		 + vertex_normals.capacity() * sizeof(vec3)
+		 + face_bvh.memory_size();
+}
+
+size_t MeshGeometry::memory_size() const {
+	size_t size = MeshLevel::memory_size() - sizeof(MeshLevel) + sizeof(MeshGeometry)
+				+ texture_coordinates.capacity() * sizeof(vec3);
+	for (const MeshLevel& level : lods) {
+		size += level.memory_size();
+	}
+	return size;
+}
+
+// lazy meshes are loaded and unloaded many times, so after the first load the finished geometry
+// (including normals, hierarchy and levels of detail) is stored in a binary file next to the obj
+std::shared_ptr<const MeshGeometry> Mesh::load_geometry() const {
+	auto loaded_geometry = std::make_shared<MeshGeometry>();
+	std::string cache_file = filename + ".geometry";
+	if (read_geometry_cache(cache_file, *loaded_geometry)) {
+		if (!detail_levels) {
+			loaded_geometry->lods.clear(); // cached by a run that used them
+		}
+		else if (loaded_geometry->lods.empty()) { // cached by a run without them
+			build_lods(*loaded_geometry);
+			if (!loaded_geometry->lods.empty()) {
+				write_geometry_cache(cache_file, *loaded_geometry);
+			}
+		}
+		return loaded_geometry;
+	}
+
+	*loaded_geometry = MeshGeometry();
+	ObjHeader header; // the header fields are set already, other threads may be reading them
+	if (!parse_obj(filename, loaded_geometry.get(), header)) {
+		std::cerr << "Failed to load mesh from: " << filename << "\n";
+	}
+	calculate_vertex_normals(*loaded_geometry);
+	build_bvh(*loaded_geometry);
+	if (detail_levels) {
+		build_lods(*loaded_geometry);
+	}
+	write_geometry_cache(cache_file, *loaded_geometry);
+	return loaded_geometry;
+}
+
+
+namespace {
+	const char geometry_cache_magic[8] = {'L', 'E', 'O', 'G', 'E', 'O', '2', '\0'};
+
+	template <typename T>
+	void write_array(std::ofstream& file, const std::vector<T>& values) {
+		uint64_t count = values.size();
+		file.write(reinterpret_cast<const char*>(&count), sizeof(count));
+		file.write(reinterpret_cast<const char*>(values.data()), count * sizeof(T));
+	}
+
+	template <typename T>
+	bool read_array(std::ifstream& file, std::vector<T>& values) {
+		uint64_t count = 0;
+		file.read(reinterpret_cast<char*>(&count), sizeof(count));
+		if (!file || count > (uint64_t(1) << 32)) {
+			return false;
+		}
+		values.resize(count);
+		file.read(reinterpret_cast<char*>(values.data()), count * sizeof(T));
+		return bool(file);
+	}
+
+	// the parts every level has (texture coordinates are stored once for the whole mesh)
+	void write_level(std::ofstream& file, const MeshLevel& level) {
+		file.write(reinterpret_cast<const char*>(&level.error), sizeof(level.error));
+		write_array(file, level.vertices);
+		write_array(file, level.faces);
+		write_array(file, level.vertex_normals);
+		write_array(file, level.face_bvh.nodes);
+		write_array(file, level.face_bvh.primitive_indices);
+	}
+
+	bool read_level(std::ifstream& file, MeshLevel& level) {
+		file.read(reinterpret_cast<char*>(&level.error), sizeof(level.error));
+		return file
+			&& read_array(file, level.vertices)
+			&& read_array(file, level.faces)
+			&& read_array(file, level.vertex_normals)
+			&& read_array(file, level.face_bvh.nodes)
+			&& read_array(file, level.face_bvh.primitive_indices);
+	}
+}
+
+bool Mesh::read_geometry_cache(const std::string& cache_file, MeshGeometry& geometry) const {
+	if (!is_up_to_date(cache_file, filename)) {
+		return false;
+	}
+
+	std::ifstream file(cache_file, std::ios::binary);
+	char magic[8];
+	file.read(magic, sizeof(magic));
+	if (!file || !std::equal(magic, magic + 8, geometry_cache_magic)) {
+		return false;
+	}
+	if (!read_level(file, geometry) || !read_array(file, geometry.texture_coordinates)) {
+		return false;
+	}
+
+	uint64_t lod_count = 0;
+	file.read(reinterpret_cast<char*>(&lod_count), sizeof(lod_count));
+	if (!file || lod_count > 64) {
+		return false;
+	}
+	geometry.lods.resize(lod_count);
+	for (MeshLevel& level : geometry.lods) {
+		if (!read_level(file, level)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+void Mesh::write_geometry_cache(const std::string& cache_file, const MeshGeometry& geometry) const {
+	std::string temporary_file = temporary_name(cache_file);
+	{
+		std::ofstream file(temporary_file, std::ios::binary);
+		if (!file.is_open()) {
+			return; // read only asset directory, the obj is parsed every time
+		}
+		file.write(geometry_cache_magic, sizeof(geometry_cache_magic));
+		write_level(file, geometry);
+		write_array(file, geometry.texture_coordinates);
+
+		uint64_t lod_count = geometry.lods.size();
+		file.write(reinterpret_cast<const char*>(&lod_count), sizeof(lod_count));
+		for (const MeshLevel& level : geometry.lods) {
+			write_level(file, level);
+		}
+	}
+	replace_file(temporary_file, cache_file); // if it fails the obj is parsed again next time
+}
+
+const MeshGeometry& Mesh::get_geometry(std::shared_ptr<const MeshGeometry>& pinned) const {
+	if (!lazy) {
+		return *geometry; // never changes after the constructor
+	}
+	pinned = acquire_geometry();
+	return *pinned;
+}
+
+std::shared_ptr<const MeshGeometry> Mesh::acquire_geometry() const {
+	// one store per mesh and epoch, the render threads only read the line while the mesh is hot
+	int64_t epoch = GeometryCache::global().get_epoch();
+	if (last_used.load(std::memory_order_relaxed) != epoch) {
+		last_used.store(epoch, std::memory_order_relaxed);
+	}
+
+	std::shared_ptr<const MeshGeometry> current = std::atomic_load(&geometry);
+	if (current) {
+		return current;
+	}
+
+	std::lock_guard<std::mutex> lock(load_mutex);
+	current = std::atomic_load(&geometry);
+	if (!current) { // nobody else loaded it in the meantime
+		current = load_geometry();
+		std::atomic_store(&geometry, current);
+		GeometryCache::global().loaded(this, current->memory_size());
+	}
+	return current;
+}
+
+
+GeometryCache& GeometryCache::global() {
+	static GeometryCache cache;
+	return cache;
+}
+
+void GeometryCache::set_budget(size_t bytes) {
+	std::lock_guard<std::mutex> lock(cache_mutex);
+	budget = bytes;
+	evict(nullptr);
+}
+
+size_t GeometryCache::get_memory_usage() const {
+	std::lock_guard<std::mutex> lock(cache_mutex);
+	return memory_usage;
+}
+
+void GeometryCache::loaded(const Mesh* mesh, size_t bytes) {
+	std::lock_guard<std::mutex> lock(cache_mutex);
+	mesh->last_used = ++epoch; // newer than everything that was used before the load
+	resident.push_back({mesh, bytes});
+	memory_usage += bytes;
+	evict(mesh);
+}
+
+void GeometryCache::forget(const Mesh* mesh) {
+	std::lock_guard<std::mutex> lock(cache_mutex);
+	for (size_t i = 0; i < resident.size(); i++) {
+		if (resident[i].mesh == mesh) {
+			memory_usage -= resident[i].bytes;
+			resident.erase(resident.begin() + i);
+			return;
+		}
+	}
+}
+
+// unload the coldest meshes until the budget fits again (never the mesh that was just loaded)
+void GeometryCache::evict(const Mesh* keep) {
+	while (memory_usage > budget) {
+		int coldest = -1;
+		for (size_t i = 0; i < resident.size(); i++) {
+			if (resident[i].mesh != keep &&
+				(coldest < 0 || resident[i].mesh->last_used < resident[coldest].mesh->last_used)) {
+				coldest = int(i);
+			}
+		}
+		if (coldest < 0) {
+			return;
+		}
+		std::atomic_store(&resident[coldest].mesh->geometry, std::shared_ptr<const MeshGeometry>());
+		memory_usage -= resident[coldest].bytes;
+		resident.erase(resident.begin() + coldest);
+	}
+}
+
+
+void Mesh::calculate_vertex_normals(MeshLevel& level) { // average from adjacent faces
+    const std::vector<point3>& vertices = level.vertices;
+    std::vector<vec3>& vertex_normals = level.vertex_normals;
     vertex_normals.assign(vertices.size(), vec3(0.0f, 0.0f, 0.0f));
 
-    for (const Face &face : faces) {
+    for (const Face &face : level.faces) {
         int index_0 = face.face_vertices[0];
         int index_1 = face.face_vertices[1];
         int index_2 = face.face_vertices[2];
@@ -139,7 +558,12 @@ double Mesh::get_ray_mesh_intersection(const ray& render_ray, const point3 trian
 }
 
 
-vec3 Mesh::get_normal_vector(const int& face_index, const ray& render_ray) const {
+vec3 Mesh::get_normal_vector(const int& face_index, const ray& render_ray, int lod) const {
+    std::shared_ptr<const MeshGeometry> pinned; // keeps a lazy geometry loaded until we are done
+    const MeshLevel& level = get_geometry(pinned).get_level(lod);
+    const std::vector<point3>& vertices = level.vertices;
+    const std::vector<Face>& faces = level.faces;
+    const std::vector<vec3>& vertex_normals = level.vertex_normals;
     vec3 normal_vector;
     point3 triangle[3];
     triangle[0] = vertices[faces[face_index].face_vertices[0]];
@@ -158,31 +582,83 @@ vec3 Mesh::get_normal_vector(const int& face_index, const ray& render_ray) const
     vec3 normal_1 = vertex_normals[faces[face_index].face_vertices[1]];
     vec3 normal_2 = vertex_normals[faces[face_index].face_vertices[2]];
 
+    double u, v;
+    get_barycentric(level, face_index, render_ray, u, v);
+    double w = 1.0 - u - v;
+   
+	normal_vector = (normal_0 * w) + (normal_1 * u) + (normal_2 * v);
+    return normalize(normal_vector);
+}
+
+
+// position of the hit inside the triangle (same math as the intersection)
+void Mesh::get_barycentric(const int& face_index, const ray& render_ray, double& u, double& v, int lod) const {
+    std::shared_ptr<const MeshGeometry> pinned; // keeps a lazy geometry loaded until we are done
+    get_barycentric(get_geometry(pinned).get_level(lod), face_index, render_ray, u, v);
+}
+
+void Mesh::get_barycentric(const MeshLevel& level, const int& face_index, const ray& render_ray, double& u, double& v) const {
+    const std::vector<point3>& vertices = level.vertices;
+    const std::vector<Face>& faces = level.faces;
+    point3 triangle[3];
+    triangle[0] = vertices[faces[face_index].face_vertices[0]];
+    triangle[1] = vertices[faces[face_index].face_vertices[1]];
+    triangle[2] = vertices[faces[face_index].face_vertices[2]];
+
+    vec3 edge_1 = triangle[1] - triangle[0];
+    vec3 edge_2 = triangle[2] - triangle[0];
+
     vec3 p_vector = cross(render_ray.direction(), edge_2);
     double determinant = dot(edge_1, p_vector);
 
     double inverse_determinant = 1.0 / determinant;
     vec3 ray_to_vertex0 = render_ray.origin() - triangle[0];
-    double u = dot(ray_to_vertex0, p_vector) * inverse_determinant;
+    u = dot(ray_to_vertex0, p_vector) * inverse_determinant;
 
     vec3 q = cross(ray_to_vertex0, edge_1);
-    double v = dot(render_ray.direction(), q) * inverse_determinant;
-    double w = 1.0 - u - v;
-   
-	normal_vector = (normal_0 * w) + (normal_1 * u) + (normal_2 * v);
-    return normalize(normal_vector);
+    v = dot(render_ray.direction(), q) * inverse_determinant;
+}
+
+
+bool Mesh::obj_changed() const {
+	std::error_code error;
+	return !filename.empty() && std::filesystem::last_write_time(filename, error) > loaded_time && !error;
 }
 
 
 RayHit Mesh::hit(const ray& render_ray) {
+    return hit(render_ray, 0);
+}
+
+RayHit Mesh::hit(const ray& render_ray, double max_lod_error) {
+    std::shared_ptr<const MeshGeometry> pinned; // keeps a lazy geometry loaded until we are done
+    const MeshGeometry& geometry = get_geometry(pinned);
+    int lod = 0;
+    while (max_lod_error > 0 && lod < int(geometry.lods.size()) && geometry.lods[lod].error <= max_lod_error) {
+        lod++;
+    }
+    return hit_level(render_ray, geometry.get_level(lod), lod);
+}
+
+RayHit Mesh::hit_level(const ray& render_ray, int lod) {
+    std::shared_ptr<const MeshGeometry> pinned;
+    const MeshGeometry& geometry = get_geometry(pinned);
+    lod = std::clamp(lod, 0, int(geometry.lods.size())); // a level the mesh does not have means its coarsest one
+    return hit_level(render_ray, geometry.get_level(lod), lod);
+}
+
+RayHit Mesh::hit_level(const ray& render_ray, const MeshLevel& level, int lod) const {
+    const std::vector<point3>& vertices = level.vertices;
+    const std::vector<Face>& faces = level.faces;
     RayHit local_ray_hit;
     local_ray_hit.hit_time = -1; // no hit
     local_ray_hit.face_id = -1;
+    local_ray_hit.lod = lod;
     double best_time = std::numeric_limits<double>::max();
-    int face_index = 0;
 
-	// add bounding box hierarchy!!!
-    for (const auto& current_face : faces) {
+	// only the faces in the leaves of the hierarchy that the ray passes through are tested
+	level.face_bvh.traverse(render_ray, best_time, [&](int face_index, double& closest_time) {
+        const Face& current_face = faces[face_index];
         point3 triangle[3];
         triangle[0] = vertices[current_face.face_vertices[0]];
         triangle[1] = vertices[current_face.face_vertices[1]];
@@ -190,18 +666,46 @@ RayHit Mesh::hit(const ray& render_ray) {
 
         double hit_time = get_ray_mesh_intersection(render_ray, triangle);
 
-        if (hit_time > 0.0001 && hit_time < best_time) {
-            best_time = hit_time;
+        if (hit_time > 0.0001 && hit_time < closest_time) {
+            closest_time = hit_time;
             local_ray_hit.hit_time = hit_time;
             local_ray_hit.face_id = face_index;
-			local_ray_hit.hit_object = this; // add pointer to object
+			local_ray_hit.hit_object = const_cast<Mesh*>(this); // add pointer to object
         }
-        face_index++;
-    }
+	});
     return local_ray_hit;
 }
 
 
+void Mesh::hit_packet(RayPacket& packet, uint64_t ray_mask, RayHit* hits) const {
+    std::shared_ptr<const MeshGeometry> pinned; // keeps a lazy geometry loaded until we are done
+    const MeshGeometry& geometry = get_geometry(pinned);
+    const std::vector<point3>& vertices = geometry.vertices;
+    const std::vector<Face>& faces = geometry.faces;
+
+	geometry.face_bvh.traverse_packet(packet, ray_mask, [&](int face_index, uint64_t leaf_mask) {
+        const Face& current_face = faces[face_index];
+        point3 triangle[3];
+        triangle[0] = vertices[current_face.face_vertices[0]];
+        triangle[1] = vertices[current_face.face_vertices[1]];
+        triangle[2] = vertices[current_face.face_vertices[2]];
+
+        for (int r = 0; r < packet.size; r++) {
+            if (!((leaf_mask >> r) & 1)) {
+                continue;
+            }
+            double hit_time = get_ray_mesh_intersection(packet.rays[r], triangle);
+            if (hit_time > 0.0001 && hit_time < packet.closest_times[r]) {
+                packet.closest_times[r] = hit_time;
+                hits[r].hit_time = hit_time;
+                hits[r].face_id = face_index;
+                hits[r].hit_object = const_cast<Mesh*>(this);
+            }
+        }
+	});
+}
+
+
 bool Mesh::bound_hit(const ray& r) { 
     double t_min = -std::numeric_limits<double>::infinity();
     double t_max = std::numeric_limits<double>::infinity();
@@ -258,7 +762,7 @@ bool Mesh::bound_hit(const ray& ray) { //, AABB aabb, float tmin, float tmax) {
 */
 
 
-void Mesh::get_bounding_box() {
+void Mesh::get_bounding_box(const MeshGeometry& geometry) {
     double max_x = -std::numeric_limits<double>::infinity();;
 	double min_x = std::numeric_limits<double>::infinity();;
 	double max_y = -std::numeric_limits<double>::infinity();;
@@ -266,7 +770,7 @@ void Mesh::get_bounding_box() {
 	double max_z = -std::numeric_limits<double>::infinity();;
 	double min_z = std::numeric_limits<double>::infinity();;
 
-	for (const auto& vertice : vertices) {
+	for (const auto& vertice : geometry.vertices) {
 		if (vertice.x() > max_x) {
 		    max_x = vertice.x();
 		}
@@ -292,6 +796,28 @@ void Mesh::get_bounding_box() {
 }
 
 
+void Mesh::build_bvh(MeshLevel& level) {
+	const std::vector<point3>& vertices = level.vertices;
+	const std::vector<Face>& faces = level.faces;
+	std::vector<AABB> face_bounds(faces.size());
+	for (size_t i = 0; i < faces.size(); i++) {
+		for (int corner = 0; corner < 3; corner++) {
+			face_bounds[i].grow(vertices[faces[i].face_vertices[corner]]);
+		}
+	}
+	level.face_bvh.build(face_bounds); // large meshes are split across threads
+}
+
+
+void Mesh::build_lods(MeshGeometry& geometry) {
+	geometry.lods = build_detail_levels(geometry, geometry.texture_coordinates, lod_min_faces);
+	for (MeshLevel& level : geometry.lods) {
+		calculate_vertex_normals(level);
+		build_bvh(level);
+	}
+}
+
+
 vec3 Mesh::get_specular_direction(const ray& render_ray, const vec3& face_normal) {
     double dot_product = dot(render_ray.direction(), face_normal);
 	return render_ray.direction() - (face_normal * 2 * dot_product);
@@ -327,6 +853,50 @@ vec3 Mesh::get_diffuse_direction(const vec3& face_normal) {
 color Mesh::get_color() const{
 	return material_pointer->get_color();
 }
+color Mesh::get_color(const int& face_index, const ray& render_ray, const double& footprint, int lod) const{
+	if (!material_pointer->get_diffuse_texture()) {
+		return material_pointer->get_color();
+	}
+	double u, v;
+	get_barycentric(face_index, render_ray, u, v, lod);
+	return get_color(face_index, u, v, footprint, lod);
+}
+color Mesh::get_color(const int& face_index, double u, double v, const double& footprint, int lod) const{
+	const Texture* texture = material_pointer->get_diffuse_texture();
+	if (!texture) {
+		return material_pointer->get_color();
+	}
+
+    std::shared_ptr<const MeshGeometry> pinned; // keeps a lazy geometry loaded until we are done
+    const MeshGeometry& geometry = get_geometry(pinned);
+	const MeshLevel& mesh_level = geometry.get_level(lod);
+	const std::vector<point3>& vertices = mesh_level.vertices;
+	const std::vector<vec3>& texture_coordinates = geometry.texture_coordinates;
+	const Face& face = mesh_level.faces[face_index];
+	for (int i = 0; i < 3; i++) {
+		if (face.face_uvs[i] < 0 || face.face_uvs[i] >= int(texture_coordinates.size())) {
+			return material_pointer->get_color(); // no or broken texture coordinates
+		}
+	}
+
+	double w = 1.0 - u - v;
+	vec3 uv = texture_coordinates[face.face_uvs[0]] * w + texture_coordinates[face.face_uvs[1]] * u + texture_coordinates[face.face_uvs[2]] * v;
+
+	// mip level: how many texels of level 0 fit across the footprint of the ray
+	point3 triangle[3];
+	vec3 triangle_uvs[3];
+	for (int i = 0; i < 3; i++) {
+		triangle[i] = vertices[face.face_vertices[i]];
+		triangle_uvs[i] = texture_coordinates[face.face_uvs[i]] * vec3(texture->get_width(), texture->get_height(), 0);
+	}
+	double world_area = cross(triangle[1] - triangle[0], triangle[2] - triangle[0]).length();
+	double texel_area = cross(triangle_uvs[1] - triangle_uvs[0], triangle_uvs[2] - triangle_uvs[0]).length();
+	double level = 0;
+	if (world_area > 0 && texel_area > 0 && footprint > 0) {
+		level = std::log2(std::max(1.0, footprint * std::sqrt(texel_area / world_area)));
+	}
+	return material_pointer->get_color(uv.x(), uv.y(), level);
+}
 color Mesh::get_emission() const{
     return material_pointer->get_emission();
 }
@@ -0,0 +1,548 @@
+#include "renderer.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <numeric>
+#include <thread>
+
+// RENDERER //
+// Leo Martin (2025) //
+
+
+namespace {
+    using render_clock = std::chrono::steady_clock;
+
+    const int packet_width = 8; // 8x8 camera rays per packet
+
+    // every thread takes the next free tile until all tiles are done or should_stop returns true
+    void render_tiles(const std::vector<Tile>& tiles, int threads, const std::function<void(const Tile&)>& render_tile,
+                      const std::function<bool()>& should_stop) {
+        std::atomic<size_t> next_tile(0);
+
+        auto render_worker = [&]() {
+            for (size_t t = next_tile++; t < tiles.size() && !should_stop(); t = next_tile++) {
+                render_tile(tiles[t]);
+            }
+        };
+
+        std::vector<std::thread> workers;
+        for (int t = 1; t < threads; t++) {
+            workers.emplace_back(render_worker);
+        }
+        render_worker(); // the calling thread helps as well
+        for (std::thread& worker : workers) {
+            worker.join();
+        }
+    }
+
+    // true once cancel is set or time_budget seconds (0 = no limit) have passed since the call
+    std::function<bool()> make_stop_check(const std::atomic<bool>* cancel, double time_budget) {
+        auto deadline = render_clock::now() + std::chrono::duration_cast<render_clock::duration>(std::chrono::duration<double>(time_budget));
+        return [=]() {
+            return (cancel && cancel->load()) || (time_budget > 0 && render_clock::now() >= deadline);
+        };
+    }
+
+    // weight of a sample that is distance pixels (along one axis) away from the middle of a pixel
+    double filter_weight(PixelFilter filter, double distance, double radius) {
+        distance = std::fabs(distance);
+        if (distance > radius) {
+            return 0;
+        }
+        if (filter == PixelFilter::tent) {
+            return 1 - distance / radius;
+        }
+        if (filter == PixelFilter::blackman_harris) { // window over [-radius, radius], 1 in the middle
+            double t = 2 * pi * (0.5 + 0.5 * distance / radius);
+            return 0.35875 - 0.48829 * std::cos(t) + 0.14128 * std::cos(2 * t) - 0.01168 * std::cos(3 * t);
+        }
+        return 1;
+    }
+}
+
+
+void Camera::look(const point3& new_position, const point3& new_look_at, const vec3& new_up) {
+    position = new_position;
+    look_at = new_look_at;
+    up = new_up;
+    forward = normalize(look_at - position);
+    right = normalize(cross(forward, up));
+    image_up = cross(right, forward);
+}
+
+ray Camera::get_ray(double x, double y, int image_width, int image_height) const {
+    // in double, so cameras far from the origin and sub-pixel positions keep their precision
+    double pixel_size = image_plane_width / image_width;
+    double x_pos = -image_plane_width / 2 + pixel_size * x;
+    double y_pos = pixel_size * image_height / 2 - pixel_size * y;
+
+    point3 cell_center = position + forward * image_plane_distance + right * x_pos + image_up * y_pos;
+    return ray(cell_center, normalize(cell_center - position));
+}
+
+void Camera::sample_pixel(int i, int j, int count, std::vector<vec3>& positions) const {
+    if (pixel_sampling == PixelSampling::center) {
+        for (int s = 0; s < count; s++) {
+            positions.push_back(vec3(i + 0.5, j + 0.5, 0));
+        }
+        return;
+    }
+    if (pixel_sampling == PixelSampling::jittered) {
+        for (int s = 0; s < count; s++) {
+            positions.push_back(vec3(i + random_double(), j + random_double(), 0));
+        }
+        return;
+    }
+
+    int grid = int(std::lround(std::sqrt(double(count))));
+    if (grid * grid == count) { // one sample per grid cell
+        for (int s = 0; s < count; s++) {
+            positions.push_back(vec3(i + (s % grid + random_double()) / grid, j + (s / grid + random_double()) / grid, 0));
+        }
+        return;
+    }
+
+    // every column and every row of a count x count grid gets one sample (rows shuffled)
+    std::vector<int> rows(count);
+    std::iota(rows.begin(), rows.end(), 0);
+    for (int s = count - 1; s > 0; s--) {
+        std::swap(rows[s], rows[std::min(s, int(random_double() * (s + 1)))]);
+    }
+    for (int s = 0; s < count; s++) {
+        positions.push_back(vec3(i + (s + random_double()) / count, j + (rows[s] + random_double()) / count, 0));
+    }
+}
+
+
+bool Renderer::matches_image_size(const Framebuffer& framebuffer) const {
+    if (framebuffer.width != settings.image_width || framebuffer.height != settings.image_height) {
+        std::cerr << "Framebuffer is " << framebuffer.width << "x" << framebuffer.height << " but the image is "
+                  << settings.image_width << "x" << settings.image_height << "\n";
+        return false;
+    }
+    return true;
+}
+
+ray Renderer::get_camera_ray(int i, int j) const {
+    return camera.get_ray(i + 0.5, j + 0.5, settings.image_width, settings.image_height);
+}
+
+double Renderer::get_filter_radius() const {
+    double radius = settings.filter_radius;
+    if (radius <= 0) {
+        radius = settings.pixel_filter == PixelFilter::box ? 0.5 : settings.pixel_filter == PixelFilter::tent ? 1 : 2;
+    }
+    return std::max(0.5, radius); // a smaller filter would miss samples of its own pixel
+}
+
+
+bool Renderer::render(Framebuffer& framebuffer, const RenderCallbacks& callbacks, const std::atomic<bool>* cancel) {
+    int threads = settings.threads > 0 ? settings.threads : std::max(1u, std::thread::hardware_concurrency());
+    int pixel_count = settings.image_width * settings.image_height;
+    if (!matches_image_size(framebuffer)) {
+        return false;
+    }
+
+    color_sum.assign(pixel_count, color(0, 0, 0));
+    weight_sum.assign(pixel_count, 0);
+    sample_count.assign(pixel_count, 0);
+    std::fill(framebuffer.pixels, framebuffer.pixels + pixel_count, color(0, 0, 0));
+
+    // angle covered by one pixel (for texture filtering)
+    trace_settings = TraceSettings();
+    trace_settings.pixel_spread = camera.image_plane_width / settings.image_width / camera.image_plane_distance;
+    trace_settings.use_lod = settings.mesh_lod;
+    trace_settings.lod_start_bounce = settings.lod_start_bounce;
+
+    // a new guide learns from scratch every render
+    guide.reset();
+    if (settings.path_guiding) {
+        guide = std::make_unique<PathGuide>(scene.get_bounds());
+        if (settings.guide_training_passes <= 0) {
+            guide->stop_training();
+        }
+    }
+    trace_settings.guide = guide.get();
+    trace_settings.guide_fraction = settings.guide_fraction;
+
+    clear_path_cache();
+    paths_recorded = settings.record_paths;
+    recorded_geometry_version = scene.get_geometry_version();
+
+    std::function<bool()> should_stop = make_stop_check(cancel, settings.time_budget);
+
+    // render tiles in the order of a space filling curve
+    std::vector<Tile> tiles = make_tiles(settings.image_width, settings.image_height, settings.tile_size, settings.tile_order);
+
+    int primary_samples = std::max(1, settings.primary_samples);
+    auto render_pass = [&](int pass, int scale, int pass_samples, int pass_primary_samples) {
+        render_tiles(tiles, threads, [&](const Tile& tile) {
+            render_pass_tile(framebuffer, tile, tiles.size(), pass, scale, pass_samples, pass_primary_samples);
+            if (callbacks.tile_done) {
+                callbacks.tile_done(tile, pass);
+            }
+        }, should_stop);
+
+        // what the pass recorded is used from the next pass on (coarse passes only add to the next full one)
+        if (guide && guide->is_training() && scale == 1) {
+            guide->refine();
+            if (guide->get_iteration() >= settings.guide_training_passes) {
+                guide->stop_training();
+            }
+        }
+    };
+
+    // passes of doubling samples, so the guide can learn in between. the paths per camera ray are split,
+    // or the camera rays per pixel if every camera ray has only one path
+    if (!settings.progressive && guide) {
+        bool split_rays = settings.samples == 1;
+        int budget = split_rays ? primary_samples : settings.samples;
+        if (budget == 1) {
+            std::cerr << "Path guiding has nothing to learn from with one path per pixel (set samples or primary_samples > 1)\n";
+        }
+        int pass = 0;
+        int total = 0;
+        while (total < budget && !should_stop()) {
+            int pass_budget = std::min(std::max(1, total), budget - total);
+            if (split_rays) {
+                render_pass(pass, 1, 1, pass_budget);
+            }
+            else {
+                render_pass(pass, 1, pass_budget, primary_samples);
+            }
+            total += pass_budget;
+            if (callbacks.pass_done) {
+                callbacks.pass_done(pass, split_rays ? 1 : total);
+            }
+            pass++;
+        }
+        return !should_stop();
+    }
+
+    if (!settings.progressive) {
+        render_pass(0, 1, settings.samples, primary_samples);
+        if (callbacks.pass_done && !should_stop()) {
+            callbacks.pass_done(0, settings.samples);
+        }
+        return !should_stop();
+    }
+
+    int pass = 0;
+    for (int scale = settings.coarse_scale; scale >= 1 && !should_stop(); scale /= 2, pass++) {
+        render_pass(pass, scale, 1, primary_samples);
+        if (callbacks.pass_done) {
+            callbacks.pass_done(pass, scale == 1 ? 1 : 0);
+        }
+    }
+
+    int total_samples = 1;
+    while (total_samples < settings.target_samples && !should_stop()) {
+        int pass_samples = std::min(total_samples, settings.target_samples - total_samples);
+        render_pass(pass, 1, pass_samples, primary_samples);
+        total_samples += pass_samples;
+        if (callbacks.pass_done) {
+            callbacks.pass_done(pass, total_samples);
+        }
+        pass++;
+    }
+    return !should_stop();
+}
+
+
+// traces the pixels of a tile on a grid with the given spacing, each with primary_samples camera rays
+// and pass_samples paths per camera ray
+void Renderer::render_pass_tile(Framebuffer& framebuffer, const Tile& tile, size_t tile_count, int pass, int scale, int pass_samples,
+                                int primary_samples) {
+    seed_random(tile.index + 1 + pass * tile_count); // same noise no matter which thread renders the tile
+    GeometryCache::global().next_epoch(); // lazy meshes hit from now on count as used by this tile
+    int image_width = settings.image_width;
+
+    // the coarse passes and the first full one of a progressive render skip the pixels a coarser pass
+    // traced already, so every pixel has exactly one sample after them
+    int fill_passes = 0;
+    for (int coarse_scale = settings.coarse_scale; settings.progressive && coarse_scale >= 1; coarse_scale /= 2) {
+        fill_passes++;
+    }
+
+    std::vector<PixelSample> tile_samples;
+    std::vector<ray> tile_rays;
+    std::vector<vec3> positions;
+    for (int j = tile.y0; j < tile.y1; j += scale) { // row
+        for (int i = tile.x0; i < tile.x1; i += scale) { // column
+            if (pass < fill_passes && sample_count[j * image_width + i] > 0) {
+                continue; // already traced by a coarser pass
+            }
+            positions.clear();
+            camera.sample_pixel(i, j, primary_samples, positions);
+            for (const vec3& position : positions) {
+                tile_samples.push_back({j * image_width + i, position.x(), position.y()});
+                tile_rays.push_back(camera.get_ray(position.x(), position.y(), settings.image_width, settings.image_height));
+            }
+        }
+    }
+
+    std::vector<RayHit> primary_hits;
+    if (settings.primary_ray_packets) {
+        trace_primary_packets(tile, scale, tile_samples, tile_rays, primary_hits);
+    }
+    const std::vector<RayHit>* known_primary_hits = settings.primary_ray_packets ? &primary_hits : nullptr;
+
+    RecordedTile recorded;
+    PathRecord* record = nullptr;
+    if (paths_recorded) {
+        recorded = {tile, pass, scale, pass_samples, primary_samples, tile_samples, PathRecord()};
+        record = &recorded.paths;
+    }
+
+    std::vector<color> tile_colors;
+    if (settings.sort_secondary_rays) {
+        scene.trace_paths_sorted(tile_rays, pass_samples, settings.max_bounces, trace_settings, tile_colors, known_primary_hits, record);
+    }
+    else {
+        for (size_t p = 0; p < tile_rays.size(); p++) {
+            const RayHit* known_primary_hit = known_primary_hits ? &primary_hits[p] : nullptr;
+            tile_colors.push_back(scene.trace_path(tile_rays[p], pass_samples, settings.max_bounces, trace_settings, known_primary_hit, record));
+        }
+    }
+
+    add_tile_samples(framebuffer, tile, scale, pass_samples, tile_samples, tile_colors);
+    if (record) {
+        keep_recorded_tile(std::move(recorded));
+    }
+}
+
+
+// splats the colors of the camera rays of a pass (each the average of pass_samples paths) into the pixels
+// within the filter radius. on coarse grids the result also fills the pixels of the block that have no samples yet
+void Renderer::add_tile_samples(Framebuffer& framebuffer, const Tile& tile, int scale, int pass_samples,
+                                const std::vector<PixelSample>& tile_samples, const std::vector<color>& sample_colors) {
+    int image_width = settings.image_width;
+    double radius = get_filter_radius();
+
+    // sums of the tile and the border the filter reaches into its neighbours, added to the image at once
+    int margin = int(std::ceil(radius));
+    int x0 = std::max(0, tile.x0 - margin);
+    int x1 = std::min(settings.image_width, tile.x1 + margin);
+    int y0 = std::max(0, tile.y0 - margin);
+    int y1 = std::min(settings.image_height, tile.y1 + margin);
+    int region_width = x1 - x0;
+    std::vector<color> region_color(region_width * (y1 - y0), color(0, 0, 0));
+    std::vector<double> region_weight(region_width * (y1 - y0), 0);
+
+    std::vector<double> weights_x(2 * margin + 2);
+    for (size_t s = 0; s < tile_samples.size(); s++) {
+        const PixelSample& sample = tile_samples[s];
+        int first_x = std::max(x0, int(std::ceil(sample.x - radius - 0.5))); // pixels whose middle is within the radius
+        int last_x = std::min(x1 - 1, int(std::floor(sample.x + radius - 0.5)));
+        int first_y = std::max(y0, int(std::ceil(sample.y - radius - 0.5)));
+        int last_y = std::min(y1 - 1, int(std::floor(sample.y + radius - 0.5)));
+        for (int x = first_x; x <= last_x; x++) { // the filter is separable
+            weights_x[x - first_x] = filter_weight(settings.pixel_filter, x + 0.5 - sample.x, radius) * pass_samples;
+        }
+        for (int y = first_y; y <= last_y; y++) {
+            double weight_y = filter_weight(settings.pixel_filter, y + 0.5 - sample.y, radius);
+            for (int x = first_x; x <= last_x; x++) {
+                double weight = weight_y * weights_x[x - first_x];
+                region_color[(y - y0) * region_width + x - x0] += sample_colors[s] * weight;
+                region_weight[(y - y0) * region_width + x - x0] += weight;
+            }
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(add_mutex);
+    for (const PixelSample& sample : tile_samples) {
+        sample_count[sample.pixel] += pass_samples;
+    }
+    for (int y = y0; y < y1; y++) {
+        for (int x = x0; x < x1; x++) {
+            double weight = region_weight[(y - y0) * region_width + x - x0];
+            if (weight == 0) {
+                continue;
+            }
+            int pixel = y * image_width + x;
+            color_sum[pixel] += region_color[(y - y0) * region_width + x - x0];
+            weight_sum[pixel] += weight;
+            if (sample_count[pixel] > 0 && weight_sum[pixel] > 0) { // pixels without samples of their own show the coarse block
+                framebuffer.pixels[pixel] = color_sum[pixel] / weight_sum[pixel];
+            }
+        }
+    }
+
+    if (scale == 1) {
+        return;
+    }
+    for (const PixelSample& sample : tile_samples) {
+        int i = sample.pixel % image_width;
+        int j = sample.pixel / image_width;
+        for (int y = j; y < std::min(j + scale, tile.y1); y++) {
+            for (int x = i; x < std::min(i + scale, tile.x1); x++) {
+                if (sample_count[y * image_width + x] == 0) {
+                    framebuffer.pixels[y * image_width + x] = framebuffer.pixels[sample.pixel];
+                }
+            }
+        }
+    }
+}
+
+
+// PATH CACHE //
+// render() can record the hits of every path per tile and pass. shading them again with the current
+// materials gives the image a new render would give (the random numbers do not depend on the materials),
+// except where a roughness changed: the bounce directions depend on it, so those tiles are traced again //
+
+void Renderer::clear_path_cache() {
+    std::lock_guard<std::mutex> lock(record_mutex);
+    recorded_tiles.clear();
+    recorded_tiles.shrink_to_fit();
+    path_cache_size = 0;
+    paths_recorded = false;
+}
+
+// only a complete set of paths is of any use, so all of them are dropped once the budget is exceeded
+void Renderer::keep_recorded_tile(RecordedTile recorded) {
+    std::lock_guard<std::mutex> lock(record_mutex);
+    if (!paths_recorded) {
+        return;
+    }
+    size_t size = sizeof(RecordedTile) + recorded.samples.capacity() * sizeof(PixelSample) + recorded.paths.memory_size();
+    if (path_cache_size + size > settings.path_cache_budget) {
+        recorded_tiles.clear();
+        recorded_tiles.shrink_to_fit();
+        path_cache_size = 0;
+        paths_recorded = false;
+        return;
+    }
+    path_cache_size += size;
+    recorded_tiles.push_back(std::move(recorded));
+}
+
+bool Renderer::render_materials(Framebuffer& framebuffer, const RenderCallbacks& callbacks, const std::atomic<bool>* cancel) {
+    if (paths_recorded && (scene.get_geometry_version() != recorded_geometry_version || scene.geometry_changed())) {
+        std::cerr << "Geometry changed since the paths were recorded, they are dropped (render() traces them again)\n";
+        clear_path_cache(); // their hits belong to the old faces
+    }
+    if (!paths_recorded || !matches_image_size(framebuffer)) {
+        return false;
+    }
+    int threads = settings.threads > 0 ? settings.threads : std::max(1u, std::thread::hardware_concurrency());
+    int pixel_count = settings.image_width * settings.image_height;
+    size_t tile_count = make_tiles(settings.image_width, settings.image_height, settings.tile_size, settings.tile_order).size();
+
+    color_sum.assign(pixel_count, color(0, 0, 0));
+    weight_sum.assign(pixel_count, 0);
+    sample_count.assign(pixel_count, 0);
+    std::fill(framebuffer.pixels, framebuffer.pixels + pixel_count, color(0, 0, 0));
+
+    // every tile goes back into the cache once it is shaded (or traced and recorded again)
+    std::vector<RecordedTile> replayed;
+    {
+        std::lock_guard<std::mutex> lock(record_mutex);
+        replayed.swap(recorded_tiles);
+        path_cache_size = 0;
+    }
+
+    std::function<bool()> should_stop = make_stop_check(cancel, settings.time_budget);
+    std::vector<char> handled(replayed.size(), false); // tiles that went back into the cache already
+
+    int total_samples = 0;
+    for (size_t first = 0, last = 0; first < replayed.size() && !should_stop(); first = last) {
+        int pass = replayed[first].pass;
+        int scale = replayed[first].scale;
+        int pass_samples = replayed[first].pass_samples;
+        std::vector<Tile> tiles;
+        std::vector<int> recorded_index(tile_count, -1);
+        for (last = first; last < replayed.size() && replayed[last].pass == pass; last++) {
+            tiles.push_back(replayed[last].tile);
+            recorded_index[replayed[last].tile.index] = int(last);
+        }
+
+        render_tiles(tiles, threads, [&](const Tile& tile) {
+            RecordedTile& recorded = replayed[recorded_index[tile.index]];
+            handled[recorded_index[tile.index]] = true;
+            if (recorded.paths.is_stale()) {
+                render_pass_tile(framebuffer, tile, tile_count, pass, recorded.scale, recorded.pass_samples, recorded.primary_samples);
+            }
+            else {
+                std::vector<color> sample_colors(recorded.samples.size());
+                for (size_t p = 0; p < recorded.samples.size(); p++) {
+                    color sample_color(0, 0, 0);
+                    for (int s = 0; s < recorded.pass_samples; s++) {
+                        sample_color += recorded.paths.shade(p * recorded.pass_samples + s);
+                    }
+                    sample_colors[p] = sample_color / recorded.pass_samples;
+                }
+                add_tile_samples(framebuffer, tile, recorded.scale, recorded.pass_samples, recorded.samples, sample_colors);
+                keep_recorded_tile(std::move(recorded));
+            }
+            if (callbacks.tile_done) {
+                callbacks.tile_done(tile, pass);
+            }
+        }, should_stop);
+
+        if (!std::all_of(handled.begin() + first, handled.begin() + last, [](char done) { return done; })) {
+            break; // stopped in the middle of the pass
+        }
+        if (scale == 1) {
+            total_samples += pass_samples;
+        }
+        if (callbacks.pass_done) {
+            callbacks.pass_done(pass, scale == 1 ? total_samples : 0);
+        }
+    }
+
+    // a stopped replay puts the tiles it did not get to back, so the next one still has all of them
+    bool completed = true;
+    for (size_t r = 0; r < replayed.size(); r++) {
+        if (!handled[r]) {
+            keep_recorded_tile(std::move(replayed[r]));
+            completed = false;
+        }
+    }
+    {
+        std::lock_guard<std::mutex> lock(record_mutex);
+        std::stable_sort(recorded_tiles.begin(), recorded_tiles.end(),
+                         [](const RecordedTile& a, const RecordedTile& b) { return a.pass < b.pass; });
+    }
+    return completed;
+}
+
+
+// primary hits of the tile, the pixels are grouped into blocks of 8x8 traced pixels (on coarse grids the
+// blocks are larger) and the n-th camera rays of the pixels of a block are traced as one packet from the camera position
+void Renderer::trace_primary_packets(const Tile& tile, int scale, const std::vector<PixelSample>& tile_samples, const std::vector<ray>& tile_rays,
+                                     std::vector<RayHit>& primary_hits) const {
+    int block_size = packet_width * scale;
+    int blocks_x = (tile.x1 - tile.x0 + block_size - 1) / block_size;
+    int blocks_y = (tile.y1 - tile.y0 + block_size - 1) / block_size;
+    int rays_per_pixel = std::max(1, settings.primary_samples);
+
+    std::vector<std::vector<int>> blocks(blocks_x * blocks_y * rays_per_pixel); // indices into tile_samples
+    int pixel_ray = 0; // which camera ray of its pixel the sample is (the rays of a pixel follow each other)
+    for (size_t p = 0; p < tile_samples.size(); p++) {
+        pixel_ray = p > 0 && tile_samples[p - 1].pixel == tile_samples[p].pixel ? pixel_ray + 1 : 0;
+        int i = tile_samples[p].pixel % settings.image_width;
+        int j = tile_samples[p].pixel / settings.image_width;
+        int block = ((j - tile.y0) / block_size) * blocks_x + (i - tile.x0) / block_size;
+        blocks[block * rays_per_pixel + pixel_ray].push_back(int(p));
+    }
+
+    primary_hits.resize(tile_rays.size());
+    RayPacket packet;
+    RayHit packet_hits[RayPacket::max_size];
+    for (const std::vector<int>& block : blocks) {
+        if (block.empty()) {
+            continue;
+        }
+        packet.size = 0;
+        for (int p : block) {
+            packet.add(tile_rays[p]);
+        }
+        packet.build_frustum(camera.get_position());
+        scene.trace_packet(packet, packet_hits);
+        for (size_t r = 0; r < block.size(); r++) {
+            primary_hits[block[r]] = packet_hits[r];
+        }
+    }
+}
@@ -0,0 +1,321 @@
+#include "simplify.h"
+
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <queue>
+#include <utility>
+
+// MESH SIMPLIFICATION //
+// every vertex collects the planes of its faces in a quadric, the edge whose merged vertex would be the
+// closest to all planes of both ends is collapsed first //
+
+
+namespace {
+    const double border_weight = 10; // open borders are kept in place more strongly than the surface
+
+    // sum of squared distances to a set of planes (upper half of a symmetric 4x4 matrix)
+    struct Quadric {
+        double a2 = 0, ab = 0, ac = 0, ad = 0;
+        double b2 = 0, bc = 0, bd = 0;
+        double c2 = 0, cd = 0;
+        double d2 = 0;
+
+        // plane dot(normal, p) + d = 0 with a unit normal
+        void add_plane(const vec3& normal, double d, double weight) {
+            double a = normal.x(), b = normal.y(), c = normal.z();
+            a2 += weight * a * a; ab += weight * a * b; ac += weight * a * c; ad += weight * a * d;
+            b2 += weight * b * b; bc += weight * b * c; bd += weight * b * d;
+            c2 += weight * c * c; cd += weight * c * d;
+            d2 += weight * d * d;
+        }
+
+        void operator+=(const Quadric& other) {
+            a2 += other.a2; ab += other.ab; ac += other.ac; ad += other.ad;
+            b2 += other.b2; bc += other.bc; bd += other.bd;
+            c2 += other.c2; cd += other.cd;
+            d2 += other.d2;
+        }
+
+        double error(const point3& p) const {
+            double x = p.x(), y = p.y(), z = p.z();
+            return a2 * x * x + 2 * ab * x * y + 2 * ac * x * z + 2 * ad * x
+                 + b2 * y * y + 2 * bc * y * z + 2 * bd * y
+                 + c2 * z * z + 2 * cd * z
+                 + d2;
+        }
+
+        // point with the smallest error (cramer's rule), false if there is no single one (flat or straight surroundings)
+        bool optimal_point(point3& p) const {
+            vec3 column_0(a2, ab, ac);
+            vec3 column_1(ab, b2, bc);
+            vec3 column_2(ac, bc, c2);
+            vec3 right_side(-ad, -bd, -cd);
+            double determinant = dot(column_0, cross(column_1, column_2));
+            if (std::fabs(determinant) < 1e-10) {
+                return false;
+            }
+            p = point3(dot(right_side, cross(column_1, column_2)),
+                       dot(column_0, cross(right_side, column_2)),
+                       dot(column_0, cross(column_1, right_side))) / determinant;
+            return true;
+        }
+    };
+
+    struct Collapse {
+        double cost;
+        int keep, remove; // vertex remove is merged into vertex keep
+        int keep_stamp, remove_stamp;
+        point3 position;
+    };
+
+    struct CheaperFirst {
+        bool operator()(const Collapse& a, const Collapse& b) const { return a.cost > b.cost; }
+    };
+}
+
+
+std::vector<MeshLevel> build_detail_levels(const MeshLevel& mesh, std::vector<vec3>& texture_coordinates, int min_faces,
+                                           int reduction) {
+    std::vector<MeshLevel> levels;
+    size_t target_faces = mesh.faces.size() / reduction;
+    if (target_faces < size_t(min_faces)) {
+        return levels; // small meshes are cheap enough as they are
+    }
+
+    std::vector<point3> positions = mesh.vertices;
+    std::vector<Face> faces = mesh.faces;
+    std::vector<bool> face_alive(faces.size(), true);
+    std::vector<bool> vertex_alive(positions.size(), true);
+    std::vector<int> stamps(positions.size(), 0); // changes whenever a vertex moves, older collapses are planned again
+    std::vector<std::vector<int>> vertex_faces(positions.size());
+    std::vector<Quadric> quadrics(positions.size());
+    size_t face_count = faces.size();
+
+    // planes of the faces, and how often every edge is used
+    std::map<std::pair<int, int>, std::pair<int, int>> edges; // (smaller, larger vertex) -> (use count, face)
+    for (size_t f = 0; f < faces.size(); f++) {
+        const int* corners = faces[f].face_vertices;
+        vec3 normal = cross(positions[corners[1]] - positions[corners[0]], positions[corners[2]] - positions[corners[0]]);
+        if (normal.length() > 0) {
+            normal = normal / normal.length();
+            for (int c = 0; c < 3; c++) {
+                quadrics[corners[c]].add_plane(normal, -dot(normal, positions[corners[0]]), 1);
+            }
+        }
+        for (int c = 0; c < 3; c++) {
+            vertex_faces[corners[c]].push_back(int(f));
+            std::pair<int, int> edge = std::minmax(corners[c], corners[(c + 1) % 3]);
+            edges[edge].first++;
+            edges[edge].second = int(f);
+        }
+    }
+
+    // open borders get a plane through the edge that stands upright on its face
+    for (const auto& [edge, use] : edges) {
+        if (use.first != 1) {
+            continue;
+        }
+        const int* corners = faces[use.second].face_vertices;
+        vec3 face_normal = cross(positions[corners[1]] - positions[corners[0]], positions[corners[2]] - positions[corners[0]]);
+        vec3 border_normal = cross(positions[edge.second] - positions[edge.first], face_normal);
+        if (border_normal.length() == 0) {
+            continue;
+        }
+        border_normal = border_normal / border_normal.length();
+        double d = -dot(border_normal, positions[edge.first]);
+        quadrics[edge.first].add_plane(border_normal, d, border_weight);
+        quadrics[edge.second].add_plane(border_normal, d, border_weight);
+    }
+
+    // best position for the merged vertex: the optimum of the quadric if it is near the edge, else an end or the middle
+    auto plan = [&](int keep, int remove) {
+        Quadric merged = quadrics[keep];
+        merged += quadrics[remove];
+        const point3& a = positions[keep];
+        const point3& b = positions[remove];
+
+        Collapse collapse = {0, keep, remove, stamps[keep], stamps[remove], (a + b) / 2};
+        collapse.cost = merged.error(collapse.position);
+        point3 candidates[3] = {a, b, point3()};
+        int candidate_count = 2;
+        if (merged.optimal_point(candidates[2]) && (candidates[2] - (a + b) / 2).length() <= (b - a).length()) {
+            candidate_count = 3;
+        }
+        for (int i = 0; i < candidate_count; i++) {
+            double cost = merged.error(candidates[i]);
+            if (cost < collapse.cost) {
+                collapse.cost = cost;
+                collapse.position = candidates[i];
+            }
+        }
+        collapse.cost = std::max(0.0, collapse.cost);
+        return collapse;
+    };
+
+    auto shares_face = [&](int v, int other) {
+        for (int f : vertex_faces[v]) {
+            const int* corners = faces[f].face_vertices;
+            if (face_alive[f] && (corners[0] == other || corners[1] == other || corners[2] == other)) {
+                return true;
+            }
+        }
+        return false;
+    };
+
+    // moving v must not turn any of its faces around (the faces shared with other disappear anyway)
+    auto flips_faces = [&](int v, int other, const point3& position) {
+        for (int f : vertex_faces[v]) {
+            const int* corners = faces[f].face_vertices;
+            if (!face_alive[f] || corners[0] == other || corners[1] == other || corners[2] == other) {
+                continue;
+            }
+            point3 before[3], after[3];
+            for (int c = 0; c < 3; c++) {
+                before[c] = positions[corners[c]];
+                after[c] = corners[c] == v ? position : before[c];
+            }
+            vec3 normal_before = cross(before[1] - before[0], before[2] - before[0]);
+            vec3 normal_after = cross(after[1] - after[0], after[2] - after[0]);
+            if (dot(normal_before, normal_after) <= 0.2 * normal_before.length() * normal_after.length()) {
+                return true;
+            }
+        }
+        return false;
+    };
+
+    std::priority_queue<Collapse, std::vector<Collapse>, CheaperFirst> queue;
+    for (const auto& edge : edges) {
+        queue.push(plan(edge.first.first, edge.first.second));
+    }
+
+    double max_cost = 0;
+    while (!queue.empty()) {
+        Collapse collapse = queue.top();
+        queue.pop();
+        int keep = collapse.keep;
+        int remove = collapse.remove;
+        if (!vertex_alive[keep] || !vertex_alive[remove]) {
+            continue;
+        }
+        if (collapse.keep_stamp != stamps[keep] || collapse.remove_stamp != stamps[remove]) {
+            if (shares_face(keep, remove)) {
+                queue.push(plan(keep, remove)); // an end moved, the cost changed
+            }
+            continue;
+        }
+        if (flips_faces(keep, remove, collapse.position) || flips_faces(remove, keep, collapse.position)) {
+            continue;
+        }
+
+        // the faces on the edge know the texture coordinates of both ends, the merged corner gets the one
+        // at its place along the edge. corners of the other faces with the same coordinates follow it
+        // (corners across a texture seam keep theirs)
+        std::vector<std::pair<int, int>> uv_merges[2]; // (old, new) for the corners of keep and of remove
+        vec3 edge = positions[remove] - positions[keep];
+        double edge_length_squared = dot(edge, edge);
+        double t = edge_length_squared > 0 ? std::clamp(dot(collapse.position - positions[keep], edge) / edge_length_squared, 0.0, 1.0) : 0;
+        for (int f : vertex_faces[remove]) {
+            const Face& face = faces[f];
+            int keep_corner = -1, remove_corner = -1;
+            for (int c = 0; c < 3; c++) {
+                if (face.face_vertices[c] == keep) {
+                    keep_corner = c;
+                }
+                else if (face.face_vertices[c] == remove) {
+                    remove_corner = c;
+                }
+            }
+            if (!face_alive[f] || keep_corner < 0 || face.face_uvs[keep_corner] < 0 || face.face_uvs[remove_corner] < 0) {
+                continue;
+            }
+            int keep_uv = face.face_uvs[keep_corner];
+            int remove_uv = face.face_uvs[remove_corner];
+            int merged_uv = int(texture_coordinates.size());
+            texture_coordinates.push_back(texture_coordinates[keep_uv] * (1 - t) + texture_coordinates[remove_uv] * t);
+            uv_merges[0].push_back({keep_uv, merged_uv});
+            uv_merges[1].push_back({remove_uv, merged_uv});
+        }
+        for (int v = 0; v < 2; v++) {
+            int vertex = v == 0 ? keep : remove;
+            for (int f : vertex_faces[vertex]) {
+                Face& face = faces[f];
+                for (int c = 0; c < 3; c++) {
+                    for (const auto& [old_uv, new_uv] : uv_merges[v]) {
+                        if (face.face_vertices[c] == vertex && face.face_uvs[c] == old_uv) {
+                            face.face_uvs[c] = new_uv;
+                            break;
+                        }
+                    }
+                }
+            }
+        }
+
+        // merge remove into keep, the faces on the edge disappear
+        positions[keep] = collapse.position;
+        quadrics[keep] += quadrics[remove];
+        vertex_alive[remove] = false;
+        stamps[keep]++;
+        for (int f : vertex_faces[remove]) {
+            if (!face_alive[f]) {
+                continue;
+            }
+            int* corners = faces[f].face_vertices;
+            if (corners[0] == keep || corners[1] == keep || corners[2] == keep) {
+                face_alive[f] = false;
+                face_count--;
+                continue;
+            }
+            for (int c = 0; c < 3; c++) {
+                if (corners[c] == remove) {
+                    corners[c] = keep;
+                }
+            }
+            vertex_faces[keep].push_back(f);
+        }
+        vertex_faces[remove].clear();
+        max_cost = std::max(max_cost, collapse.cost);
+
+        // the edges around the moved vertex have new costs
+        std::vector<int>& keep_faces = vertex_faces[keep];
+        keep_faces.erase(std::remove_if(keep_faces.begin(), keep_faces.end(), [&](int f) { return !face_alive[f]; }), keep_faces.end());
+        for (int f : keep_faces) {
+            for (int c = 0; c < 3; c++) {
+                if (faces[f].face_vertices[c] != keep) {
+                    queue.push(plan(keep, faces[f].face_vertices[c]));
+                }
+            }
+        }
+
+        if (face_count > target_faces) {
+            continue;
+        }
+
+        // snapshot of the current state as the next level (only the vertices that are still used)
+        MeshLevel level;
+        std::vector<int> new_index(positions.size(), -1);
+        for (size_t f = 0; f < faces.size(); f++) {
+            if (!face_alive[f]) {
+                continue;
+            }
+            Face face = faces[f];
+            for (int c = 0; c < 3; c++) {
+                int& index = new_index[face.face_vertices[c]];
+                if (index < 0) {
+                    index = int(level.vertices.size());
+                    level.vertices.push_back(positions[face.face_vertices[c]]);
+                }
+                face.face_vertices[c] = index;
+            }
+            level.faces.push_back(face);
+        }
+        level.error = std::sqrt(max_cost); // squared distances to the original planes add up, so this bounds the distance
+        levels.push_back(level);
+
+        target_faces /= reduction;
+        if (target_faces < size_t(min_faces)) {
+            break;
+        }
+    }
+    return levels;
+}
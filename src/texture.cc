@@ -0,0 +1,203 @@
+#include "texture.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+
+// TEXTURE CACHE //
+// Leo Martin (2025) //
+
+
+namespace {
+    std::atomic<uint32_t> next_texture_id(0);
+
+    // skips whitespace and comments between the fields of a ppm header
+    void skip_ppm_whitespace(std::istream& file) {
+        while (true) {
+            int next = file.peek();
+            if (next == '#') {
+                std::string comment;
+                std::getline(file, comment);
+            }
+            else if (std::isspace(next)) {
+                file.get();
+            }
+            else {
+                return;
+            }
+        }
+    }
+}
+
+
+Texture::Texture(const std::string& filename) : filename(filename), texture_id(next_texture_id++) {
+    // only the header is read here, the texels are loaded tile by tile when they are needed
+    std::ifstream file(filename, std::ios::binary);
+    if (!file.is_open()) {
+        std::cerr << "Failed to load texture from: " << filename << "\n";
+        return;
+    }
+
+    std::string magic;
+    int max_value = 0;
+    file >> magic;
+    skip_ppm_whitespace(file);
+    file >> width;
+    skip_ppm_whitespace(file);
+    file >> height;
+    skip_ppm_whitespace(file);
+    file >> max_value;
+    file.get(); // single whitespace before the pixel data
+
+    if (magic != "P6" || width <= 0 || height <= 0 || max_value != 255) {
+        std::cerr << "Texture has to be a binary 8 bit ppm (P6): " << filename << "\n";
+        return;
+    }
+
+    data_offset = file.tellg();
+    level_count = 1;
+    while ((width >> level_count) > 0 || (height >> level_count) > 0) {
+        level_count++;
+    }
+    valid = true;
+}
+
+
+color Texture::sample(double u, double v, double level) const {
+    if (!valid) {
+        return color(1, 1, 1);
+    }
+    int mip = std::clamp(int(std::lround(level)), 0, level_count - 1);
+    int level_width = get_level_width(mip);
+    int level_height = get_level_height(mip);
+
+    // wrap around and flip v (obj has v pointing up, images start at the top)
+    u -= std::floor(u);
+    v -= std::floor(v);
+    int x = std::min(int(u * level_width), level_width - 1);
+    int y = std::min(int((1 - v) * level_height), level_height - 1);
+
+    std::shared_ptr<const TextureTile> tile = TextureCache::global().get(*this, mip, x / texture_tile_size, y / texture_tile_size);
+    int index = 3 * ((y % texture_tile_size) * tile->width + (x % texture_tile_size));
+    return color(tile->texels[index], tile->texels[index + 1], tile->texels[index + 2]) / 255.0;
+}
+
+
+std::shared_ptr<const TextureTile> Texture::load_tile(int level, int tile_x, int tile_y) const {
+    int level_width = get_level_width(level);
+    int level_height = get_level_height(level);
+    int x0 = tile_x * texture_tile_size;
+    int y0 = tile_y * texture_tile_size;
+
+    auto tile = std::make_shared<TextureTile>();
+    tile->width = std::min(texture_tile_size, level_width - x0);
+    tile->height = std::min(texture_tile_size, level_height - y0);
+    tile->texels.resize(3 * tile->width * tile->height);
+
+    if (level == 0) { // read the rows of the tile straight from the file
+        std::ifstream file(filename, std::ios::binary);
+        for (int row = 0; row < tile->height; row++) {
+            file.seekg(data_offset + 3 * (std::streamoff(y0 + row) * width + x0));
+            file.read(reinterpret_cast<char*>(&tile->texels[3 * row * tile->width]), 3 * tile->width);
+        }
+        return tile;
+    }
+
+    // every texel is the average of 2x2 texels of the level below (those lie in at most 2x2 tiles)
+    int lower_width = get_level_width(level - 1);
+    int lower_height = get_level_height(level - 1);
+    std::shared_ptr<const TextureTile> lower_tiles[2][2];
+    for (int y = 0; y < tile->height; y++) {
+        for (int x = 0; x < tile->width; x++) {
+            int sum[3] = {0, 0, 0};
+            for (int dy = 0; dy < 2; dy++) {
+                for (int dx = 0; dx < 2; dx++) {
+                    int lower_x = std::min(2 * (x0 + x) + dx, lower_width - 1);
+                    int lower_y = std::min(2 * (y0 + y) + dy, lower_height - 1);
+                    int local_tile_x = lower_x / texture_tile_size - 2 * tile_x;
+                    int local_tile_y = lower_y / texture_tile_size - 2 * tile_y;
+
+                    std::shared_ptr<const TextureTile>& lower_tile = lower_tiles[local_tile_y][local_tile_x];
+                    if (!lower_tile) {
+                        lower_tile = TextureCache::global().get(*this, level - 1, lower_x / texture_tile_size, lower_y / texture_tile_size);
+                    }
+                    int index = 3 * ((lower_y % texture_tile_size) * lower_tile->width + (lower_x % texture_tile_size));
+                    for (int c = 0; c < 3; c++) {
+                        sum[c] += lower_tile->texels[index + c];
+                    }
+                }
+            }
+            for (int c = 0; c < 3; c++) {
+                tile->texels[3 * (y * tile->width + x) + c] = uint8_t((sum[c] + 2) / 4);
+            }
+        }
+    }
+    return tile;
+}
+
+
+TextureCache& TextureCache::global() {
+    static TextureCache cache;
+    return cache;
+}
+
+void TextureCache::set_budget(size_t bytes) {
+    for (Shard& shard : shards) {
+        std::lock_guard<std::mutex> lock(shard.shard_mutex);
+        shard.budget = bytes / shard_count;
+        evict(shard);
+    }
+}
+
+size_t TextureCache::get_memory_usage() const {
+    size_t usage = 0;
+    for (const Shard& shard : shards) {
+        std::lock_guard<std::mutex> lock(shard.shard_mutex);
+        usage += shard.memory_usage;
+    }
+    return usage;
+}
+
+
+std::shared_ptr<const TextureTile> TextureCache::get(const Texture& texture, int level, int tile_x, int tile_y) {
+    // texture id (24 bit), mip level (8 bit), tile position (16 bit each)
+    uint64_t key = (uint64_t(texture.get_id()) << 40) | (uint64_t(level) << 32) | (uint64_t(tile_y) << 16) | uint64_t(tile_x);
+    Shard& shard = shards[(key ^ (key >> 17) ^ (key >> 40)) % shard_count];
+
+    {
+        std::lock_guard<std::mutex> lock(shard.shard_mutex);
+        auto found = shard.entries.find(key);
+        if (found != shard.entries.end()) {
+            shard.lru.splice(shard.lru.begin(), shard.lru, found->second.lru_position); // mark as recently used
+            return found->second.tile;
+        }
+    }
+
+    // load without holding the lock, other threads keep reading the cache meanwhile
+    std::shared_ptr<const TextureTile> tile = texture.load_tile(level, tile_x, tile_y);
+
+    std::lock_guard<std::mutex> lock(shard.shard_mutex);
+    auto found = shard.entries.find(key);
+    if (found != shard.entries.end()) {
+        return found->second.tile; // another thread loaded the same tile first
+    }
+    shard.lru.push_front(key);
+    shard.entries[key] = Entry{tile, shard.lru.begin()};
+    shard.memory_usage += tile->memory_size();
+    evict(shard);
+    return tile; // evicted tiles stay alive as long as someone still holds them
+}
+
+
+void TextureCache::evict(Shard& shard) {
+    while (shard.memory_usage > shard.budget && shard.lru.size() > 1) {
+        uint64_t key = shard.lru.back();
+        shard.lru.pop_back();
+        auto found = shard.entries.find(key);
+        shard.memory_usage -= found->second.tile->memory_size();
+        shard.entries.erase(found);
+    }
+}
@@ -0,0 +1,28 @@
+#ifndef CHECK_H
+#define CHECK_H
+
+#include <iostream>
+
+// TEST HELPERS //
+// every test is a small program run by ctest, failed checks are printed and make it return 1 //
+
+
+inline int check_failures = 0;
+
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": check failed: " #condition "\n"; \
+            check_failures++; \
+        } \
+    } while (0)
+
+inline int check_result() {
+    if (check_failures > 0) {
+        std::cerr << check_failures << " checks failed\n";
+        return 1;
+    }
+    return 0;
+}
+
+#endif
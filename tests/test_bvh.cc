@@ -0,0 +1,158 @@
+#include "bvh.h"
+#include "check.h"
+
+#include <cmath>
+#include <random>
+
+// BVH TESTS //
+// the closest hit found through the hierarchy has to be the one testing every primitive finds //
+
+
+namespace {
+    struct Sphere {
+        point3 center;
+        double radius;
+    };
+
+    // first hit in front of the origin, infinity if the ray misses
+    double hit_sphere(const Sphere& sphere, const ray& render_ray) {
+        vec3 to_origin = render_ray.origin() - sphere.center;
+        double a = dot(render_ray.direction(), render_ray.direction());
+        double half_b = dot(to_origin, render_ray.direction());
+        double c = dot(to_origin, to_origin) - sphere.radius * sphere.radius;
+        double discriminant = half_b * half_b - a * c;
+        if (discriminant < 0) {
+            return std::numeric_limits<double>::infinity();
+        }
+        double root = std::sqrt(discriminant);
+        for (double t : {(-half_b - root) / a, (-half_b + root) / a}) {
+            if (t > 1e-9) {
+                return t;
+            }
+        }
+        return std::numeric_limits<double>::infinity();
+    }
+
+    std::vector<Sphere> random_spheres(std::mt19937& random, int count) {
+        std::uniform_real_distribution<double> position(-10, 10);
+        std::uniform_real_distribution<double> radius(0.05, 0.5);
+        std::vector<Sphere> spheres;
+        for (int i = 0; i < count; i++) {
+            spheres.push_back({point3(position(random), position(random), position(random)), radius(random)});
+        }
+        return spheres;
+    }
+
+    std::vector<AABB> sphere_bounds(const std::vector<Sphere>& spheres) {
+        std::vector<AABB> bounds(spheres.size());
+        for (size_t i = 0; i < spheres.size(); i++) {
+            vec3 extent(spheres[i].radius, spheres[i].radius, spheres[i].radius);
+            bounds[i].grow(spheres[i].center - extent);
+            bounds[i].grow(spheres[i].center + extent);
+        }
+        return bounds;
+    }
+
+    ray random_ray(std::mt19937& random) {
+        std::uniform_real_distribution<double> position(-12, 12);
+        std::normal_distribution<double> direction(0, 1);
+        return ray(point3(position(random), position(random), position(random)),
+                   vec3(direction(random), direction(random), direction(random)));
+    }
+}
+
+
+void test_traverse_matches_brute_force() {
+    std::mt19937 random(1);
+    std::vector<Sphere> spheres = random_spheres(random, 3000);
+    BVH bvh;
+    bvh.build(sphere_bounds(spheres));
+
+    int hits = 0;
+    for (int r = 0; r < 2000; r++) {
+        ray render_ray = random_ray(random);
+
+        int expected = -1;
+        double expected_time = std::numeric_limits<double>::max();
+        for (size_t s = 0; s < spheres.size(); s++) {
+            double t = hit_sphere(spheres[s], render_ray);
+            if (t < expected_time) {
+                expected_time = t;
+                expected = int(s);
+            }
+        }
+
+        int found = -1;
+        double closest_time = std::numeric_limits<double>::max();
+        bvh.traverse(render_ray, closest_time, [&](int s, double& closest_time) {
+            double t = hit_sphere(spheres[s], render_ray);
+            if (t < closest_time) {
+                closest_time = t;
+                found = s;
+            }
+        });
+        CHECK(found == expected);
+        CHECK(closest_time == expected_time);
+        hits += expected >= 0;
+    }
+    CHECK(hits > 100); // the rays have to actually hit something for the test to mean anything
+}
+
+// every primitive is in exactly one leaf, and the boxes of the nodes contain their primitives
+void test_tree_structure() {
+    std::mt19937 random(2);
+    std::vector<Sphere> spheres = random_spheres(random, 1000);
+    std::vector<AABB> bounds = sphere_bounds(spheres);
+    BVH bvh;
+    bvh.build(bounds);
+
+    std::vector<int> seen(spheres.size(), 0);
+    for (int index : bvh.primitive_indices) {
+        seen[index]++;
+    }
+    for (int count : seen) {
+        CHECK(count == 1);
+    }
+
+    for (const BVHNode& node : bvh.nodes) {
+        for (int i = node.first_or_right; node.count > 0 && i < node.first_or_right + node.count; i++) {
+            const AABB& box = bounds[bvh.primitive_indices[i]];
+            for (int axis = 0; axis < 3; axis++) {
+                CHECK(node.bounds.min[axis] <= box.min[axis] && box.max[axis] <= node.bounds.max[axis]);
+            }
+        }
+    }
+}
+
+// subtrees built on their own threads are put together into the same tree a single thread builds
+void test_parallel_build() {
+    std::mt19937 random(3);
+    std::vector<AABB> bounds = sphere_bounds(random_spheres(random, 20000));
+    BVH serial, parallel;
+    serial.build(bounds, std::numeric_limits<int>::max());
+    parallel.build(bounds, 256);
+
+    CHECK(serial.primitive_indices == parallel.primitive_indices);
+    CHECK(serial.nodes.size() == parallel.nodes.size());
+    for (size_t n = 0; n < serial.nodes.size() && n < parallel.nodes.size(); n++) {
+        CHECK(serial.nodes[n].first_or_right == parallel.nodes[n].first_or_right);
+        CHECK(serial.nodes[n].count == parallel.nodes[n].count);
+    }
+}
+
+void test_empty() {
+    BVH bvh;
+    bvh.build({});
+    double closest_time = 1;
+    int calls = 0;
+    bvh.traverse(ray(point3(0, 0, 0), vec3(1, 0, 0)), closest_time, [&](int, double&) { calls++; });
+    CHECK(calls == 0);
+}
+
+int main() {
+    test_traverse_matches_brute_force();
+    test_tree_structure();
+    test_parallel_build();
+    test_empty();
+    return check_result();
+}
@@ -0,0 +1,65 @@
+#include "renderer.h"
+#include "check.h"
+
+#include <cmath>
+
+// PIXEL FILTER TESTS //
+// the filter weights of every pixel add up to one, so a plain light seen through the whole image stays plain //
+
+
+namespace {
+    // emitting square filling the view of the default camera, it reflects nothing
+    std::shared_ptr<Mesh> light_wall(const color& emission) {
+        std::vector<point3> vertices = {point3(-10, -10, 0), point3(10, -10, 0), point3(10, 10, 0), point3(-10, 10, 0)};
+        std::vector<Face> faces = {Face{{0, 1, 2}}, Face{{0, 2, 3}}};
+        return std::make_shared<Mesh>(vertices, faces, std::make_shared<Material>(color(0, 0, 0), emission));
+    }
+
+    // largest difference of a pixel to the emission
+    double render_wall(const MeshScene& scene, const color& emission, PixelFilter filter, double filter_radius, bool progressive) {
+        Renderer renderer(scene);
+        renderer.settings.image_width = 53; // tiles cut off at the border
+        renderer.settings.image_height = 37;
+        renderer.settings.tile_size = 8;
+        renderer.settings.primary_samples = 2;
+        renderer.settings.samples = 1;
+        renderer.settings.max_bounces = 1;
+        renderer.settings.threads = 4;
+        renderer.settings.pixel_filter = filter;
+        renderer.settings.filter_radius = filter_radius;
+        renderer.settings.progressive = progressive;
+        renderer.settings.target_samples = 2;
+
+        std::vector<color> pixels(53 * 37);
+        Framebuffer framebuffer = {pixels.data(), 53, 37};
+        CHECK(renderer.render(framebuffer));
+        double max_difference = 0;
+        for (const color& pixel : pixels) {
+            for (int c = 0; c < 3; c++) {
+                max_difference = std::max(max_difference, std::fabs(pixel[c] - emission[c]));
+            }
+        }
+        return max_difference;
+    }
+}
+
+
+void test_filters_keep_plain_images() {
+    color emission(0.25, 0.5, 2);
+    MeshScene scene;
+    scene.add(light_wall(emission));
+    scene.build();
+
+    for (PixelFilter filter : {PixelFilter::box, PixelFilter::tent, PixelFilter::blackman_harris}) {
+        for (double filter_radius : {0.0, 1.5, 3.0}) {
+            for (bool progressive : {false, true}) {
+                CHECK(render_wall(scene, emission, filter, filter_radius, progressive) < 1e-6);
+            }
+        }
+    }
+}
+
+int main() {
+    test_filters_keep_plain_images();
+    return check_result();
+}
@@ -0,0 +1,170 @@
+#include "leo-raytracer.h"
+#include "check.h"
+
+#include <filesystem>
+#include <fstream>
+#include <random>
+
+// GEOMETRY CACHE TESTS //
+// a lazy mesh loaded from its .bounds and .geometry files has to be the same mesh the obj gives //
+
+
+namespace {
+    const std::filesystem::path test_directory = std::filesystem::temp_directory_path() / "leo-raytracer-test-geometry-cache";
+
+    // textured uv sphere, big enough to get levels of detail
+    std::string write_test_mesh() {
+        std::filesystem::remove_all(test_directory);
+        std::filesystem::create_directories(test_directory);
+
+        std::ofstream texture(test_directory / "checker.ppm", std::ios::binary);
+        texture << "P6\n16 16\n255\n";
+        for (int y = 0; y < 16; y++) {
+            for (int x = 0; x < 16; x++) {
+                texture.put(char(x * 16)).put(char(y * 16)).put(char((x + y) % 2 * 255));
+            }
+        }
+
+        std::ofstream mtl(test_directory / "sphere.mtl");
+        mtl << "newmtl checker\nKd 0.8 0.8 0.8\nmap_Kd checker.ppm\n";
+
+        const int rings = 16, segments = 24;
+        std::ofstream obj(test_directory / "sphere.obj");
+        obj << "mtllib sphere.mtl\no sphere\n";
+        for (int r = 0; r <= rings; r++) {
+            for (int s = 0; s <= segments; s++) {
+                double theta = pi * r / rings, phi = 2 * pi * s / segments;
+                obj << "v " << std::sin(theta) * std::cos(phi) << " " << std::cos(theta) << " " << std::sin(theta) * std::sin(phi) << "\n";
+                obj << "vt " << double(s) / segments << " " << double(r) / rings << "\n";
+            }
+        }
+        obj << "usemtl checker\n";
+        for (int r = 0; r < rings; r++) {
+            for (int s = 0; s < segments; s++) {
+                int a = r * (segments + 1) + s + 1, b = a + 1, c = a + segments + 1, d = c + 1; // obj indices start at 1
+                obj << "f " << a << "/" << a << " " << c << "/" << c << " " << b << "/" << b << "\n";
+                obj << "f " << b << "/" << b << " " << c << "/" << c << " " << d << "/" << d << "\n";
+            }
+        }
+        return (test_directory / "sphere.obj").string();
+    }
+
+    // rays from around the sphere towards points inside of it
+    std::vector<ray> test_rays() {
+        std::mt19937 random(1);
+        std::normal_distribution<double> direction(0, 1);
+        std::uniform_real_distribution<double> inside(-0.8, 0.8);
+        std::vector<ray> rays;
+        for (int r = 0; r < 500; r++) {
+            vec3 start(direction(random), direction(random), direction(random));
+            point3 origin = start / start.length() * 3;
+            rays.push_back(ray(origin, point3(inside(random), inside(random), inside(random)) - origin));
+        }
+        return rays;
+    }
+
+    // hits, normals and texture colors of the mesh at full detail and at a coarse level
+    void compare_meshes(Mesh& expected, Mesh& mesh, int& lod_hits) {
+        for (const ray& render_ray : test_rays()) {
+            for (double max_lod_error : {0.0, 1.0}) {
+                RayHit expected_hit = expected.hit(render_ray, max_lod_error);
+                RayHit hit = mesh.hit(render_ray, max_lod_error);
+                CHECK(hit.face_id == expected_hit.face_id);
+                CHECK(hit.lod == expected_hit.lod);
+                CHECK(hit.hit_time == expected_hit.hit_time);
+                if (hit.face_id < 0 || hit.face_id != expected_hit.face_id || hit.lod != expected_hit.lod) {
+                    continue;
+                }
+                lod_hits += hit.lod > 0;
+                vec3 expected_normal = expected.get_normal_vector(hit.face_id, render_ray, hit.lod);
+                vec3 normal = mesh.get_normal_vector(hit.face_id, render_ray, hit.lod);
+                color expected_color = expected.get_color(hit.face_id, render_ray, 0, hit.lod);
+                color hit_color = mesh.get_color(hit.face_id, render_ray, 0, hit.lod);
+                for (int i = 0; i < 3; i++) {
+                    CHECK(normal[i] == expected_normal[i]);
+                    CHECK(hit_color[i] == expected_color[i]);
+                }
+            }
+        }
+    }
+}
+
+
+void test_round_trip() {
+    std::string filename = write_test_mesh();
+    std::filesystem::path bounds_file = filename + ".bounds";
+    std::filesystem::path cache_file = filename + ".geometry";
+
+    bool cache_has_levels = false;
+    for (bool detail_levels : {false, true, true}) { // the first run with levels finds a cache without them
+        auto cache_time = cache_has_levels ? std::filesystem::last_write_time(cache_file) : std::filesystem::file_time_type();
+
+        Mesh expected(filename, nullptr, false, detail_levels);
+        Mesh lazy(filename, nullptr, true, detail_levels);
+        CHECK(lazy.is_lazy() && !lazy.is_resident());
+        CHECK(std::filesystem::exists(bounds_file));
+        for (int i = 0; i < 3; i++) {
+            CHECK(lazy.get_bounds_min()[i] == expected.get_bounds_min()[i]);
+            CHECK(lazy.get_bounds_max()[i] == expected.get_bounds_max()[i]);
+        }
+        CHECK(lazy.get_material()->get_diffuse_texture() != nullptr);
+
+        int lod_hits = 0;
+        compare_meshes(expected, lazy, lod_hits); // loads the geometry from the obj or the cache
+        CHECK(lazy.is_resident());
+        CHECK(std::filesystem::exists(cache_file));
+        CHECK((lod_hits > 0) == detail_levels);
+        if (cache_has_levels) {
+            CHECK(std::filesystem::last_write_time(cache_file) == cache_time); // read, not written again
+        }
+        cache_has_levels = detail_levels;
+    }
+
+    // a broken cache is ignored and written again from the obj
+    std::filesystem::resize_file(cache_file, std::filesystem::file_size(cache_file) / 2);
+    Mesh expected(filename, nullptr, false, true);
+    Mesh lazy(filename, nullptr, true, true);
+    int lod_hits = 0;
+    compare_meshes(expected, lazy, lod_hits);
+    CHECK(lod_hits > 0);
+
+    std::filesystem::remove_all(test_directory);
+}
+
+// with room for two meshes, loading a third unloads the one that was not hit for the longest time
+void test_eviction() {
+    std::string filename = write_test_mesh();
+    std::vector<std::unique_ptr<Mesh>> meshes;
+    for (const char* name : {"a.obj", "b.obj", "c.obj"}) {
+        std::filesystem::copy_file(filename, test_directory / name);
+        meshes.push_back(std::make_unique<Mesh>((test_directory / name).string(), nullptr, true));
+    }
+    ray center_ray(point3(0, 0, 3), vec3(0, 0, -1));
+    GeometryCache& cache = GeometryCache::global();
+
+    meshes[0]->hit(center_ray);
+    size_t mesh_memory = cache.get_memory_usage();
+    cache.set_budget(mesh_memory * 5 / 2);
+    cache.next_epoch();
+    meshes[1]->hit(center_ray);
+    cache.next_epoch();
+    meshes[0]->hit(center_ray); // a is used again, b is the coldest now
+    meshes[0]->hit(center_ray);
+    cache.next_epoch();
+    meshes[2]->hit(center_ray);
+    CHECK(meshes[0]->is_resident());
+    CHECK(!meshes[1]->is_resident());
+    CHECK(meshes[2]->is_resident());
+    CHECK(cache.get_memory_usage() == 2 * mesh_memory);
+
+    meshes.clear();
+    CHECK(cache.get_memory_usage() == 0);
+    cache.set_budget(size_t(1) << 30);
+    std::filesystem::remove_all(test_directory);
+}
+
+int main() {
+    test_round_trip();
+    test_eviction();
+    return check_result();
+}
@@ -0,0 +1,77 @@
+#include "renderer.h"
+#include "check.h"
+
+#include <filesystem>
+#include <fstream>
+
+// LOOKDEV TESTS //
+// recorded paths are only shaded again while the geometry they hit is the same //
+
+
+namespace {
+    const std::filesystem::path test_directory = std::filesystem::temp_directory_path() / "leo-raytracer-test-lookdev";
+
+    // glowing square in front of the default camera, split into faces x faces pairs of triangles
+    void write_wall(const std::string& filename, int faces) {
+        std::ofstream obj(filename);
+        obj << "mtllib wall.mtl\no wall\n";
+        for (int y = 0; y <= faces; y++) {
+            for (int x = 0; x <= faces; x++) {
+                obj << "v " << -3 + 6.0 * x / faces << " " << -3 + 6.0 * y / faces << " 0\n";
+            }
+        }
+        obj << "usemtl wall\n";
+        for (int y = 0; y < faces; y++) {
+            for (int x = 0; x < faces; x++) {
+                int a = y * (faces + 1) + x + 1, b = a + 1, c = a + faces + 1, d = c + 1;
+                obj << "f " << a << " " << b << " " << d << "\nf " << a << " " << d << " " << c << "\n";
+            }
+        }
+    }
+}
+
+
+void test_geometry_change() {
+    std::filesystem::remove_all(test_directory);
+    std::filesystem::create_directories(test_directory);
+    std::string filename = (test_directory / "wall.obj").string();
+    std::ofstream(test_directory / "wall.mtl") << "newmtl wall\nKd 0.5 0.5 0.5\nKe 1 1 1\n";
+    write_wall(filename, 1);
+
+    MeshScene scene;
+    scene.load({filename}, 1);
+    Renderer renderer(scene);
+    renderer.settings.image_width = 16;
+    renderer.settings.image_height = 16;
+    renderer.settings.record_paths = true;
+    std::vector<color> pixels(16 * 16);
+    Framebuffer framebuffer = {pixels.data(), 16, 16};
+
+    CHECK(renderer.render(framebuffer));
+    CHECK(renderer.has_recorded_paths());
+    CHECK(!scene.geometry_changed());
+    CHECK(renderer.render_materials(framebuffer));
+
+    // the obj is exported again with other faces
+    write_wall(filename, 8);
+    std::filesystem::last_write_time(filename, std::filesystem::last_write_time(filename) + std::chrono::seconds(10));
+    CHECK(scene.geometry_changed());
+    CHECK(!renderer.render_materials(framebuffer)); // the recorded faces are gone
+    CHECK(!renderer.has_recorded_paths());
+
+    size_t version = scene.get_geometry_version();
+    CHECK(scene.reload_geometry());
+    CHECK(!scene.geometry_changed());
+    CHECK(scene.get_geometry_version() != version);
+    CHECK(!scene.reload_geometry());
+    CHECK(renderer.render(framebuffer));
+    CHECK(renderer.render_materials(framebuffer));
+    CHECK(std::fabs(pixels[8 * 16 + 8].x() - 1) < 1e-6); // the middle still sees the light
+
+    std::filesystem::remove_all(test_directory);
+}
+
+int main() {
+    test_geometry_change();
+    return check_result();
+}
@@ -0,0 +1,92 @@
+#include "ordering.h"
+#include "check.h"
+
+#include <cstdlib>
+
+// ORDERING TESTS //
+// morton and hilbert codes of small grids and the tile lists built from them //
+
+
+void test_morton() {
+    CHECK(morton_2d(0, 0) == 0);
+    CHECK(morton_2d(1, 0) == 1);
+    CHECK(morton_2d(0, 1) == 2);
+    CHECK(morton_2d(1, 1) == 3);
+    CHECK(morton_2d(2, 0) == 4);
+    CHECK(morton_2d(0xffff, 0xffff) == 0xffffffff);
+
+    CHECK(morton_3d(1, 0, 0) == 1);
+    CHECK(morton_3d(0, 1, 0) == 2);
+    CHECK(morton_3d(0, 0, 1) == 4);
+    CHECK(morton_3d(2, 0, 0) == 8);
+    CHECK(morton_3d(1023, 1023, 1023) == (1u << 30) - 1);
+    CHECK(morton_3d(1024, 0, 0) == 0); // only 10 bits per axis
+}
+
+// every cell of the grid gets its own distance and the curve only ever steps to a neighbour
+void test_hilbert() {
+    for (uint32_t n : {1u, 2u, 4u, 16u}) {
+        std::vector<std::pair<uint32_t, uint32_t>> cells(n * n, {n, n}); // cell at every distance
+        for (uint32_t y = 0; y < n; y++) {
+            for (uint32_t x = 0; x < n; x++) {
+                uint32_t distance = hilbert_2d(n, x, y);
+                CHECK(distance < n * n);
+                if (distance < n * n) {
+                    CHECK(cells[distance].first == n); // not taken yet
+                    cells[distance] = {x, y};
+                }
+            }
+        }
+        for (uint32_t d = 1; d < n * n; d++) {
+            int step = std::abs(int(cells[d].first) - int(cells[d - 1].first)) + std::abs(int(cells[d].second) - int(cells[d - 1].second));
+            CHECK(step == 1);
+        }
+    }
+}
+
+// every pixel is in exactly one tile, whatever the order
+void test_make_tiles() {
+    for (TileOrder order : {TileOrder::scanline, TileOrder::morton, TileOrder::hilbert}) {
+        int width = 50, height = 37, tile_size = 16;
+        std::vector<Tile> tiles = make_tiles(width, height, tile_size, order);
+        CHECK(tiles.size() == 4 * 3);
+
+        std::vector<int> covered(width * height, 0);
+        std::vector<int> indices(tiles.size(), 0);
+        for (const Tile& tile : tiles) {
+            CHECK(tile.x0 < tile.x1 && tile.x1 <= width);
+            CHECK(tile.y0 < tile.y1 && tile.y1 <= height);
+            CHECK(tile.index == (tile.y0 / tile_size) * 4 + tile.x0 / tile_size);
+            indices[tile.index]++;
+            for (int y = tile.y0; y < tile.y1; y++) {
+                for (int x = tile.x0; x < tile.x1; x++) {
+                    covered[y * width + x]++;
+                }
+            }
+        }
+        for (int count : covered) {
+            CHECK(count == 1);
+        }
+        for (int count : indices) {
+            CHECK(count == 1);
+        }
+    }
+
+    // row by row keeps the index order, the hilbert order of a square power of two grid never jumps
+    std::vector<Tile> scanline = make_tiles(64, 64, 8, TileOrder::scanline);
+    for (size_t t = 0; t < scanline.size(); t++) {
+        CHECK(scanline[t].index == int(t));
+    }
+    std::vector<Tile> hilbert = make_tiles(64, 64, 8, TileOrder::hilbert);
+    for (size_t t = 1; t < hilbert.size(); t++) {
+        int step = std::abs(hilbert[t].x0 - hilbert[t - 1].x0) + std::abs(hilbert[t].y0 - hilbert[t - 1].y0);
+        CHECK(step == 8);
+    }
+}
+
+int main() {
+    test_morton();
+    test_hilbert();
+    test_make_tiles();
+    return check_result();
+}
@@ -0,0 +1,156 @@
+#include "leo-raytracer.h"
+#include "check.h"
+
+#include <random>
+
+// PACKET TESTS //
+// a packet has to find the same closest hit for every ray as tracing the rays one by one //
+
+
+namespace {
+    std::vector<AABB> random_boxes(std::mt19937& random, int count) {
+        std::uniform_real_distribution<double> position(-10, 10);
+        std::uniform_real_distribution<double> size(0.05, 0.6);
+        std::vector<AABB> boxes(count);
+        for (AABB& box : boxes) {
+            point3 corner(position(random), position(random), position(random));
+            box.grow(corner);
+            box.grow(corner + vec3(size(random), size(random), size(random)));
+        }
+        return boxes;
+    }
+
+    // 8x8 rays from apex through a small square around target, like the camera rays of a pixel block.
+    // with start_spread the rays start at different distances along their lines
+    RayPacket block_packet(const point3& apex, const point3& target, double width, double start_spread, std::mt19937& random) {
+        std::uniform_real_distribution<double> start(0, start_spread);
+        RayPacket packet;
+        for (int y = 0; y < 8; y++) {
+            for (int x = 0; x < 8; x++) {
+                vec3 direction = target + vec3((x - 3.5) * width / 8, (y - 3.5) * width / 8, 0) - apex;
+                packet.add(ray(apex + direction * start(random), direction));
+            }
+        }
+        return packet;
+    }
+
+    // rays in all directions, no frustum can hold them
+    RayPacket diverging_packet(std::mt19937& random) {
+        std::normal_distribution<double> direction(0, 1);
+        RayPacket packet;
+        for (int r = 0; r < RayPacket::max_size; r++) {
+            packet.add(ray(point3(0, 0, 20), vec3(direction(random), direction(random), direction(random))));
+        }
+        return packet;
+    }
+
+    // closest box of every ray of the packet, once through traverse_packet and once ray by ray through traverse
+    void compare_with_single_rays(const BVH& bvh, const std::vector<AABB>& boxes, RayPacket& packet, int& hits) {
+        int packet_found[RayPacket::max_size];
+        std::fill(packet_found, packet_found + RayPacket::max_size, -1);
+        bvh.traverse_packet(packet, packet.full_mask(), [&](int b, uint64_t ray_mask) {
+            for (int r = 0; r < packet.size; r++) {
+                if (!((ray_mask >> r) & 1)) {
+                    continue;
+                }
+                double t = boxes[b].hit(packet.rays[r].origin(), packet.inverse_directions[r], packet.closest_times[r]);
+                if (t < packet.closest_times[r]) {
+                    packet.closest_times[r] = t;
+                    packet_found[r] = b;
+                }
+            }
+        });
+
+        for (int r = 0; r < packet.size; r++) {
+            int found = -1;
+            double closest_time = std::numeric_limits<double>::max();
+            bvh.traverse(packet.rays[r], closest_time, [&](int b, double& closest_time) {
+                double t = boxes[b].hit(packet.rays[r].origin(), packet.inverse_directions[r], closest_time);
+                if (t < closest_time) {
+                    closest_time = t;
+                    found = b;
+                }
+            });
+            CHECK(packet_found[r] == found);
+            CHECK(packet.closest_times[r] == closest_time);
+            hits += found >= 0;
+        }
+    }
+
+    // a cloud of random triangles around center
+    std::shared_ptr<Mesh> random_mesh(std::mt19937& random, const point3& center, const std::shared_ptr<Material>& material) {
+        std::uniform_real_distribution<double> offset(-1.5, 1.5);
+        std::vector<point3> vertices;
+        std::vector<Face> faces;
+        for (int f = 0; f < 200; f++) {
+            Face face;
+            for (int c = 0; c < 3; c++) {
+                face.face_vertices[c] = int(vertices.size());
+                vertices.push_back(center + vec3(offset(random), offset(random), offset(random)));
+            }
+            faces.push_back(face);
+        }
+        return std::make_shared<Mesh>(vertices, faces, material);
+    }
+}
+
+
+void test_traverse_packet() {
+    std::mt19937 random(1);
+    std::vector<AABB> boxes = random_boxes(random, 3000);
+    BVH bvh;
+    bvh.build(boxes);
+
+    std::uniform_real_distribution<double> target(-10, 10);
+    int hits = 0;
+    int frustums = 0;
+    for (int p = 0; p < 200; p++) {
+        point3 apex(0, 0, 25);
+        RayPacket packet = block_packet(apex, point3(target(random), target(random), 0), p % 2 ? 0.5 : 4, p % 4 < 2 ? 0 : 0.3, random);
+        frustums += packet.build_frustum(apex);
+        compare_with_single_rays(bvh, boxes, packet, hits);
+    }
+    for (int p = 0; p < 50; p++) {
+        RayPacket packet = diverging_packet(random);
+        CHECK(!packet.build_frustum(point3(0, 0, 20)));
+        compare_with_single_rays(bvh, boxes, packet, hits);
+    }
+    CHECK(frustums == 200);
+    CHECK(hits > 1000);
+}
+
+// the scene traces packets mesh by mesh (and falls back to single rays when few rays reach a mesh)
+void test_trace_packet() {
+    std::mt19937 random(2);
+    std::uniform_real_distribution<double> position(-6, 6);
+    auto material = std::make_shared<Material>(color(0.5, 0.5, 0.5));
+    MeshScene scene;
+    for (int m = 0; m < 30; m++) {
+        scene.add(random_mesh(random, point3(position(random), position(random), position(random)), material));
+    }
+    scene.build();
+
+    int hits = 0;
+    for (int p = 0; p < 200; p++) {
+        point3 apex(0, 0, 25);
+        RayPacket packet = block_packet(apex, point3(position(random), position(random), 0), p % 2 ? 0.5 : 6, 0, random);
+        packet.build_frustum(apex);
+        RayHit packet_hits[RayPacket::max_size];
+        scene.trace_packet(packet, packet_hits);
+
+        for (int r = 0; r < packet.size; r++) {
+            RayHit hit = scene.trace_hit(packet.rays[r]);
+            CHECK(packet_hits[r].face_id == hit.face_id);
+            CHECK(packet_hits[r].hit_object == hit.hit_object);
+            CHECK(packet_hits[r].face_id < 0 || packet_hits[r].hit_time == hit.hit_time);
+            hits += hit.face_id >= 0;
+        }
+    }
+    CHECK(hits > 1000);
+}
+
+int main() {
+    test_traverse_packet();
+    test_trace_packet();
+    return check_result();
+}
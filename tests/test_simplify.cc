@@ -0,0 +1,169 @@
+#include "leo-raytracer.h"
+#include "simplify.h"
+#include "check.h"
+
+// SIMPLIFICATION TESTS //
+// the detail levels have to get coarser step by step, stay close to the surface and keep valid texture coordinates //
+
+
+namespace {
+    // flat square grid in the xy plane with the position as texture coordinate
+    MeshLevel grid(int cells, std::vector<vec3>& texture_coordinates) {
+        MeshLevel mesh;
+        for (int y = 0; y <= cells; y++) {
+            for (int x = 0; x <= cells; x++) {
+                mesh.vertices.push_back(point3(double(x) / cells, double(y) / cells, 0));
+                texture_coordinates.push_back(vec3(double(x) / cells, double(y) / cells, 0));
+            }
+        }
+        for (int y = 0; y < cells; y++) {
+            for (int x = 0; x < cells; x++) {
+                int a = y * (cells + 1) + x, b = a + 1, c = a + cells + 1, d = c + 1;
+                Face lower = {{a, b, d}, {a, b, d}};
+                Face upper = {{a, d, c}, {a, d, c}};
+                mesh.faces.push_back(lower);
+                mesh.faces.push_back(upper);
+            }
+        }
+        return mesh;
+    }
+
+    // closed sphere with radius 1 (shared pole vertices, no texture coordinates)
+    MeshLevel sphere(int rings, int segments) {
+        MeshLevel mesh;
+        mesh.vertices.push_back(point3(0, 1, 0));
+        for (int r = 1; r < rings; r++) {
+            for (int s = 0; s < segments; s++) {
+                double theta = pi * r / rings, phi = 2 * pi * s / segments;
+                mesh.vertices.push_back(point3(std::sin(theta) * std::cos(phi), std::cos(theta), std::sin(theta) * std::sin(phi)));
+            }
+        }
+        mesh.vertices.push_back(point3(0, -1, 0));
+        int bottom = int(mesh.vertices.size()) - 1;
+        auto ring_vertex = [&](int r, int s) { return 1 + (r - 1) * segments + s % segments; };
+        for (int s = 0; s < segments; s++) {
+            mesh.faces.push_back(Face{{0, ring_vertex(1, s + 1), ring_vertex(1, s)}});
+            mesh.faces.push_back(Face{{bottom, ring_vertex(rings - 1, s), ring_vertex(rings - 1, s + 1)}});
+            for (int r = 1; r < rings - 1; r++) {
+                mesh.faces.push_back(Face{{ring_vertex(r, s), ring_vertex(r, s + 1), ring_vertex(r + 1, s + 1)}});
+                mesh.faces.push_back(Face{{ring_vertex(r, s), ring_vertex(r + 1, s + 1), ring_vertex(r + 1, s)}});
+            }
+        }
+        return mesh;
+    }
+
+    // face counts go down by the reduction, errors go up and every index points into its list
+    void check_levels(const MeshLevel& mesh, const std::vector<MeshLevel>& levels, size_t texture_coordinate_count, int min_faces) {
+        size_t faces = mesh.faces.size();
+        double error = 0;
+        for (const MeshLevel& level : levels) {
+            CHECK(level.faces.size() <= faces / 4);
+            CHECK(level.faces.size() >= size_t(min_faces));
+            CHECK(level.error >= error);
+            faces = level.faces.size();
+            error = level.error;
+            for (const Face& face : level.faces) {
+                for (int c = 0; c < 3; c++) {
+                    CHECK(face.face_vertices[c] >= 0 && face.face_vertices[c] < int(level.vertices.size()));
+                    CHECK(face.face_uvs[c] >= -1 && face.face_uvs[c] < int(texture_coordinate_count));
+                }
+            }
+        }
+    }
+}
+
+
+void test_flat_grid() {
+    std::vector<vec3> texture_coordinates;
+    MeshLevel mesh = grid(32, texture_coordinates);
+    std::vector<MeshLevel> levels = build_detail_levels(mesh, texture_coordinates, 32);
+    CHECK(levels.size() == 3); // 2048 -> 512 -> 128 -> 32 faces
+    check_levels(mesh, levels, texture_coordinates.size(), 32);
+
+    // a flat surface can be simplified without error, and the texture coordinates follow the corners
+    for (const MeshLevel& level : levels) {
+        CHECK(level.error < 1e-6);
+        for (const Face& face : level.faces) {
+            for (int c = 0; c < 3; c++) {
+                const point3& position = level.vertices[face.face_vertices[c]];
+                const vec3& uv = texture_coordinates[face.face_uvs[c]];
+                CHECK(std::fabs(position.z()) < 1e-9);
+                CHECK(std::fabs(uv.x() - position.x()) < 1e-9 && std::fabs(uv.y() - position.y()) < 1e-9);
+            }
+        }
+    }
+}
+
+void test_sphere() {
+    std::vector<vec3> texture_coordinates;
+    MeshLevel mesh = sphere(24, 32);
+    std::vector<MeshLevel> levels = build_detail_levels(mesh, texture_coordinates, 32);
+    CHECK(levels.size() == 2); // 1472 -> 368 -> 92 faces (the next level would have less than 32)
+    CHECK(texture_coordinates.empty());
+    check_levels(mesh, levels, 0, 32);
+
+    // the vertices stay within the error of the original surface (which lies a little inside the sphere)
+    for (const MeshLevel& level : levels) {
+        CHECK(level.error > 0);
+        for (const point3& vertex : level.vertices) {
+            CHECK(std::fabs(vertex.length() - 1) <= level.error + 0.01);
+        }
+    }
+}
+
+void test_small_mesh() {
+    std::vector<vec3> texture_coordinates;
+    MeshLevel mesh = grid(4, texture_coordinates); // 32 faces
+    CHECK(build_detail_levels(mesh, texture_coordinates, 32).empty());
+    CHECK(texture_coordinates.size() == 25);
+}
+
+// a ray leaving a coarse hit starts up to the error of the level inside the full detail surface, so the
+// mesh it starts on has to be intersected at that level, not at full detail (it would hit itself from inside)
+void test_rays_leaving_coarse_hits() {
+    MeshScene scene;
+    auto material = std::make_shared<Material>(color(0.5, 0.5, 0.5));
+    MeshLevel mesh = sphere(24, 32);
+    scene.add(std::make_shared<Mesh>(mesh.vertices, mesh.faces, material, false, std::vector<vec3>(), true));
+    scene.build();
+
+    seed_random(1);
+    auto random_unit = [] {
+        vec3 direction(random_double() - 0.5, random_double() - 0.5, random_double() - 0.5);
+        return direction / direction.length();
+    };
+    int coarse_hits = 0;
+    for (int r = 0; r < 500; r++) {
+        point3 origin = random_unit() * 3;
+        ray camera_ray(origin, random_unit() * 0.3 - origin / origin.length());
+        RayHit hit = scene.trace_hit(camera_ray, 1.0);
+        if (hit.face_id < 0) {
+            continue;
+        }
+        coarse_hits += hit.lod > 0;
+        Mesh* hit_mesh = dynamic_cast<Mesh*>(hit.hit_object);
+        point3 hit_point = camera_ray.at(hit.hit_time);
+        vec3 normal = hit_mesh->get_normal_vector(hit.face_id, camera_ray, hit.lod);
+        if (dot(normal, camera_ray.direction()) > 0) {
+            normal = -normal;
+        }
+
+        // leaving the sphere (full detail wanted for everything else), nothing can be hit on the way out
+        ray outward(hit_point, normal + random_unit() * 0.5);
+        CHECK(scene.trace_hit(outward, 0, hit_mesh, hit.lod).face_id < 0);
+
+        // going in, the ray reaches the other side of the sphere
+        ray inward(hit_point, random_unit() * 0.5 - normal);
+        RayHit other_side = scene.trace_hit(inward, 0, hit_mesh, hit.lod);
+        CHECK(other_side.face_id >= 0 && other_side.hit_time * inward.direction().length() > 0.5);
+    }
+    CHECK(coarse_hits > 400);
+}
+
+int main() {
+    test_flat_grid();
+    test_sphere();
+    test_small_mesh();
+    test_rays_leaving_coarse_hits();
+    return check_result();
+}
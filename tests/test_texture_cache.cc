@@ -0,0 +1,104 @@
+#include "texture.h"
+#include "check.h"
+
+#include <filesystem>
+#include <fstream>
+
+// TEXTURE CACHE TESTS //
+// tiles read through the cache (also after they were thrown out) have to match the file and its mip levels //
+
+
+namespace {
+    const int width = 512, height = 384; // 8x6 tiles on level 0
+
+    std::vector<uint8_t> write_test_texture(const std::string& filename) {
+        std::vector<uint8_t> texels(3 * width * height);
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                uint8_t* texel = &texels[3 * (y * width + x)];
+                texel[0] = uint8_t(x * 7 + y);
+                texel[1] = uint8_t(y * 3);
+                texel[2] = uint8_t(x ^ y);
+            }
+        }
+        std::ofstream file(filename, std::ios::binary);
+        file << "P6\n# test texture\n" << width << " " << height << "\n255\n";
+        file.write(reinterpret_cast<const char*>(texels.data()), texels.size());
+        return texels;
+    }
+
+    // the next mip level of a level with an even size, rounded like the texture does it
+    std::vector<uint8_t> half_level(const std::vector<uint8_t>& texels, int level_width, int level_height) {
+        std::vector<uint8_t> half(3 * (level_width / 2) * (level_height / 2));
+        for (int y = 0; y < level_height / 2; y++) {
+            for (int x = 0; x < level_width / 2; x++) {
+                for (int c = 0; c < 3; c++) {
+                    int sum = texels[3 * ((2 * y) * level_width + 2 * x) + c] + texels[3 * ((2 * y) * level_width + 2 * x + 1) + c]
+                            + texels[3 * ((2 * y + 1) * level_width + 2 * x) + c] + texels[3 * ((2 * y + 1) * level_width + 2 * x + 1) + c];
+                    half[3 * (y * (level_width / 2) + x) + c] = uint8_t((sum + 2) / 4);
+                }
+            }
+        }
+        return half;
+    }
+
+    // samples the middle of every texel of the level
+    int count_wrong_texels(const Texture& texture, int level, const std::vector<uint8_t>& texels) {
+        int level_width = width >> level, level_height = height >> level;
+        int wrong = 0;
+        for (int y = 0; y < level_height; y++) {
+            for (int x = 0; x < level_width; x++) {
+                color sampled = texture.sample((x + 0.5) / level_width, 1 - (y + 0.5) / level_height, level);
+                for (int c = 0; c < 3; c++) {
+                    wrong += int(std::lround(sampled[c] * 255)) != texels[3 * (y * level_width + x) + c];
+                }
+            }
+        }
+        return wrong;
+    }
+}
+
+
+void test_texture_cache() {
+    std::string filename = (std::filesystem::temp_directory_path() / "leo-raytracer-test-texture.ppm").string();
+    std::vector<uint8_t> levels[3];
+    levels[0] = write_test_texture(filename);
+    levels[1] = half_level(levels[0], width, height);
+    levels[2] = half_level(levels[1], width / 2, height / 2);
+
+    Texture texture(filename);
+    CHECK(texture.is_valid());
+    CHECK(texture.get_level_count() == 10);
+    TextureCache& cache = TextureCache::global();
+    size_t tile_memory = TextureTile{texture_tile_size, texture_tile_size, std::vector<uint8_t>(3 * texture_tile_size * texture_tile_size)}.memory_size();
+
+    // everything fits: every tile is loaded once and stays
+    cache.set_budget(size_t(64) << 20);
+    for (int level = 0; level < 3; level++) {
+        CHECK(count_wrong_texels(texture, level, levels[level]) == 0);
+    }
+    size_t texel_memory = 3 * (width * height + (width / 2) * (height / 2) + (width / 4) * (height / 4));
+    CHECK(cache.get_memory_usage() == (48 + 12 + 4) * sizeof(TextureTile) + texel_memory);
+    std::shared_ptr<const TextureTile> tile = cache.get(texture, 0, 3, 2);
+    CHECK(cache.get(texture, 0, 3, 2) == tile);
+
+    // lowering the budget throws tiles out right away, down to one per shard
+    cache.set_budget(0);
+    CHECK(cache.get_memory_usage() <= 16 * tile_memory);
+    CHECK(tile->texels.size() == 3 * texture_tile_size * texture_tile_size); // still held here
+
+    // thrown out tiles are loaded again, the cache never grows past its budget
+    cache.set_budget(4 * tile_memory * 16); // 4 tiles per shard
+    for (int level = 2; level >= 0; level--) {
+        CHECK(count_wrong_texels(texture, level, levels[level]) == 0);
+        CHECK(cache.get_memory_usage() <= 4 * tile_memory * 16);
+    }
+
+    cache.set_budget(size_t(256) << 20);
+    std::filesystem::remove(filename);
+}
+
+int main() {
+    test_texture_cache();
+    return check_result();
+}